@@ -12,9 +12,18 @@
 #include <linux/gfp.h>
 #include <linux/debugfs.h>
 #include <linux/slab.h>
-#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/timer.h>
+#include <linux/atomic.h>
 #include <asm/page.h>
 
+#include "eudyptula_clock.h"
+
 static const char id[] = "voidstarfoobar";
 
 static ssize_t id_read(struct file *file, char __user *user, size_t len,
@@ -77,139 +86,365 @@ static const struct file_operations id_fops = {
 };
 
 #define MAX_JIF_STR (2 + (2 * sizeof(jiffies)) + 1 + 1)
+
+/*
+ * The value is taken at open() and kept in private_data itself, so opening
+ * and reading allocates nothing; it's formatted afresh for each read.
+ */
 static ssize_t jiffies_read(struct file *file, char __user *user, size_t len,
 			    loff_t *offset)
 {
-	ssize_t retval;
-	int read_len;
+	char buf[MAX_JIF_STR];
+	int buf_len;
 
-	if (*offset >= strlen(file->private_data)) {
-		retval = 0; /* EOF */
-		goto out;
-	}
-	read_len = strlen(file->private_data) - *offset;
-	if (read_len > len)
-		read_len = len;
-	if (copy_to_user(user, file->private_data, read_len)) {
-		retval = -EFAULT;
-		goto out;
-	}
-	*offset += read_len;
-	retval = read_len;
+	buf_len = scnprintf(buf, sizeof(buf), "%#lx\n",
+			    (unsigned long)file->private_data);
 
-out:
-	return retval;
+	return simple_read_from_buffer(user, len, offset, buf, buf_len);
 }
 
 static int jiffies_open(struct inode *inode, struct file *file)
 {
-	unsigned long current_jif = jiffies;
-
-	file->private_data = kmalloc(MAX_JIF_STR, GFP_KERNEL);
-	if (!file->private_data)
-		return -ENOMEM;
-	snprintf(file->private_data, MAX_JIF_STR, "%#lx\n", current_jif);
+	file->private_data = (void *)jiffies;
 	return 0;
 }
 
-static int jiffies_release(struct inode *inode, struct file *file)
+static const struct file_operations jiffies_fops = {
+	.read = jiffies_read,
+	.open = jiffies_open,
+};
+
+#define MAX_KTIME_STR (20 + 1 + 1)
+
+/*
+ * A read at offset 0 takes a new sample, so the file can be polled with
+ * pread() without being reopened.  Read the line in one go.
+ */
+static ssize_t ktime_ns_read(struct file *file, char __user *user, size_t len,
+			     loff_t *offset)
+{
+	char buf[MAX_KTIME_STR];
+	int buf_len;
+
+	buf_len = scnprintf(buf, sizeof(buf), "%llu\n", ktime_get_ns());
+
+	return simple_read_from_buffer(user, len, offset, buf, buf_len);
+}
+
+static const struct file_operations ktime_ns_fops = {
+	.read = ktime_ns_read,
+};
+
+/*
+ * A page that userspace maps to read the time with no system call at all,
+ * refreshed every tick by a timer for as long as anyone has it mapped.
+ */
+static struct eudyptula_clock *clock_page;
+static atomic_t clock_users = ATOMIC_INIT(0);
+
+static void clock_tick(struct timer_list *timer)
+{
+	struct eudyptula_clock *clock = clock_page;
+
+	WRITE_ONCE(clock->seq, clock->seq + 1);
+	smp_wmb();
+	WRITE_ONCE(clock->jiffies, jiffies);
+	WRITE_ONCE(clock->ktime_ns, ktime_get_ns());
+	smp_wmb();
+	WRITE_ONCE(clock->seq, clock->seq + 1);
+
+	if (atomic_read(&clock_users))
+		mod_timer(timer, jiffies + 1);
+}
+
+static DEFINE_TIMER(clock_timer, clock_tick);
+
+static void clock_vm_open(struct vm_area_struct *vma)
+{
+	if (atomic_inc_return(&clock_users) == 1)
+		mod_timer(&clock_timer, jiffies);
+}
+
+static void clock_vm_close(struct vm_area_struct *vma)
 {
-	kfree(file->private_data);
+	atomic_dec(&clock_users);
+}
+
+static const struct vm_operations_struct clock_vm_ops = {
+	.open = clock_vm_open,
+	.close = clock_vm_close,
+};
+
+static int clock_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int err;
+
+	if (vma->vm_pgoff || vma_pages(vma) != 1 || (vma->vm_flags & VM_WRITE))
+		return -EINVAL;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	err = vm_insert_page(vma, vma->vm_start, virt_to_page(clock_page));
+	if (err)
+		return err;
+	vma->vm_ops = &clock_vm_ops;
+	clock_vm_open(vma); /* ->open() is only called for copies */
+
 	return 0;
 }
 
-static const struct file_operations jiffies_fops = {
-	.read = jiffies_read,
-	.open = jiffies_open,
-	.release = jiffies_release,
+static const struct file_operations clock_fops = {
+	.owner = THIS_MODULE, /* open files and mappings outlive the dentry */
+	.mmap = clock_mmap,
 };
 
-static DEFINE_MUTEX(foo_mut);
-static void *foo_buf;
+static unsigned long foo_max_size = 1 << 20;
+module_param(foo_max_size, ulong, 0444);
+MODULE_PARM_DESC(foo_max_size,
+		 "Most foo can grow to, rounded up to a page (default: 1MiB)");
+
+/*
+ * foo grows a page at a time as it's written to, up to foo_max_size.  Pages
+ * are never freed before unload, so once a page pointer is published
+ * readers can use it without any lock.
+ *
+ * Reads far outnumber writes, so readers take no lock at all: they copy
+ * straight out of the pages and go again if a write landed in the meantime.
+ * Writers copy in from userspace and allocate pages before taking the lock,
+ * so it is only ever held for a memcpy() and a slow writer can't stall
+ * anyone.  Access through mmap() gets no such consistency, of course.
+ */
+static DEFINE_SEQLOCK(foo_lock);
+static DEFINE_MUTEX(foo_grow_lock); /* serialises allocating pages */
+static struct page **foo_pages;
+static unsigned long foo_nr_pages;
+static loff_t foo_size; /* under foo_lock */
+
+static struct page *foo_page(unsigned long index)
+{
+	return smp_load_acquire(&foo_pages[index]);
+}
+
+static struct page *foo_page_get(unsigned long index)
+{
+	struct page *page = foo_page(index);
+
+	if (page)
+		return page;
+	mutex_lock(&foo_grow_lock);
+	page = foo_pages[index];
+	if (!page) {
+		page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page)
+			smp_store_release(&foo_pages[index], page);
+	}
+	mutex_unlock(&foo_grow_lock);
+
+	return page;
+}
+
+static void foo_grow(loff_t size)
+{
+	if (size > foo_size)
+		foo_size = size;
+}
+
+/* Pages that were never written read as zeroes */
+static int foo_copy_out(char __user *user, loff_t pos, size_t len)
+{
+	struct page *page;
+	size_t chunk;
+
+	for (; len; pos += chunk, user += chunk, len -= chunk) {
+		chunk = min_t(size_t, PAGE_SIZE - offset_in_page(pos), len);
+		page = foo_page(pos >> PAGE_SHIFT);
+		if (page ? copy_to_user(user,
+					page_address(page) + offset_in_page(pos),
+					chunk) :
+			   clear_user(user, chunk))
+			return -EFAULT;
+	}
+
+	return 0;
+}
+
+static void foo_copy_in(loff_t pos, const char *buf, size_t len)
+{
+	size_t chunk;
+
+	for (; len; pos += chunk, buf += chunk, len -= chunk) {
+		chunk = min_t(size_t, PAGE_SIZE - offset_in_page(pos), len);
+		memcpy(page_address(foo_page(pos >> PAGE_SHIFT)) +
+			       offset_in_page(pos),
+		       buf, chunk);
+	}
+}
 
 static ssize_t foo_read(struct file *file, char __user *user, size_t len,
 			loff_t *offset)
 {
-	ssize_t retval;
-	int read_len;
+	unsigned int seq;
+	size_t read_len;
 
-	if (*offset >= PAGE_SIZE)
-		return 0; /* EOF */
-	read_len = PAGE_SIZE - *offset;
-	if (read_len > len)
-		read_len = len;
-	if (mutex_lock_interruptible(&foo_mut))
-		return -ERESTARTSYS;
-	if (copy_to_user(user, foo_buf + *offset, read_len)) {
-		retval = -EFAULT;
-		goto out;
-	}
+	do {
+		seq = read_seqbegin(&foo_lock);
+		read_len = 0;
+		if (*offset >= foo_size)
+			continue; /* EOF */
+		read_len = min_t(loff_t, foo_size - *offset, len);
+		if (foo_copy_out(user, *offset, read_len))
+			return -EFAULT;
+	} while (read_seqretry(&foo_lock, seq));
 	*offset += read_len;
-	retval = read_len;
 
-out:
-	mutex_unlock(&foo_mut);
-	return retval;
+	return read_len;
 }
 
 static ssize_t foo_write(struct file *file, const char __user *user, size_t len,
 			 loff_t *offset)
 {
+	unsigned long index;
 	ssize_t retval;
-	int write_len;
+	void *write_buf;
+	size_t write_len;
 
-	if (*offset >= PAGE_SIZE)
+	if (*offset >= foo_max_size)
 		return -EFBIG; /* file too big */
-	write_len = PAGE_SIZE - *offset;
-	if (write_len > len)
-		write_len = len;
-	if (mutex_lock_interruptible(&foo_mut))
-		return -ERESTARTSYS;
-	if (copy_from_user(foo_buf + *offset, user, write_len)) {
-		retval = -EFAULT;
-		goto out;
+	write_len = min_t(loff_t, foo_max_size - *offset, len);
+	if (!write_len)
+		return 0;
+	write_buf = vmemdup_user(user, write_len);
+	if (IS_ERR(write_buf))
+		return PTR_ERR(write_buf);
+	for (index = *offset >> PAGE_SHIFT;
+	     index <= (*offset + write_len - 1) >> PAGE_SHIFT; index++) {
+		if (!foo_page_get(index)) {
+			retval = -ENOMEM;
+			goto out;
+		}
 	}
+	write_seqlock(&foo_lock);
+	foo_copy_in(*offset, write_buf, write_len);
+	foo_grow(*offset + write_len);
+	write_sequnlock(&foo_lock);
 	*offset += write_len;
 	retval = write_len;
 
 out:
-	mutex_unlock(&foo_mut);
+	kvfree(write_buf);
 	return retval;
 }
 
+/* Mapping a page in makes it part of the file, as if it had been written */
+static vm_fault_t foo_fault(struct vm_fault *vmf)
+{
+	struct page *page;
+
+	if (vmf->pgoff >= foo_nr_pages)
+		return VM_FAULT_SIGBUS;
+	page = foo_page_get(vmf->pgoff);
+	if (!page)
+		return VM_FAULT_OOM;
+	get_page(page);
+	vmf->page = page;
+	write_seqlock(&foo_lock);
+	foo_grow((loff_t)(vmf->pgoff + 1) << PAGE_SHIFT);
+	write_sequnlock(&foo_lock);
+
+	return 0;
+}
+
+static const struct vm_operations_struct foo_vm_ops = {
+	.fault = foo_fault,
+};
+
+static int foo_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff >= foo_nr_pages ||
+	    vma_pages(vma) > foo_nr_pages - vma->vm_pgoff)
+		return -EINVAL;
+	vma->vm_ops = &foo_vm_ops;
+
+	return 0;
+}
+
 static const struct file_operations foo_fops = {
+	.owner = THIS_MODULE, /* open files and mappings outlive the dentry */
 	.read = foo_read,
 	.write = foo_write,
+	.mmap = foo_mmap,
 };
 
+static void foo_free(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < foo_nr_pages; i++)
+		if (foo_pages[i])
+			__free_page(foo_pages[i]);
+	kvfree(foo_pages);
+}
+
 static struct dentry *eudyptula_dentry;
 
 static int debugfs_init(void)
 {
+	int err = -ENODEV;
+
 	pr_alert("debugfs module init\n");
 	eudyptula_dentry = debugfs_create_dir("eudyptula", NULL);
 	if (!eudyptula_dentry)
 		return -ENODEV;
 	if (!debugfs_create_file("id", 0666, eudyptula_dentry, NULL, &id_fops))
-		return -ENODEV;
+		goto out;
 	if (!debugfs_create_file("jiffies", 0444, eudyptula_dentry, NULL,
 				 &jiffies_fops))
-		return -ENODEV;
-	foo_buf = (void *)get_zeroed_page(GFP_KERNEL);
-	if (!foo_buf)
-		return -ENOMEM;
-	if (!debugfs_create_file("foo", 0644, eudyptula_dentry, NULL,
-				 &foo_fops)) {
-		free_page((unsigned long)foo_buf);
-		return -ENODEV;
-	}
+		goto out;
+	if (!debugfs_create_file("ktime_ns", 0444, eudyptula_dentry, NULL,
+				 &ktime_ns_fops))
+		goto out;
+	err = -ENOMEM;
+	clock_page = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!clock_page)
+		goto out;
+	/* all it has is mmap(), so it goes without the proxy, see foo */
+	err = -ENODEV;
+	if (!debugfs_create_file_unsafe("clock", 0444, eudyptula_dentry, NULL,
+					&clock_fops))
+		goto out;
+	foo_nr_pages = DIV_ROUND_UP(max(foo_max_size, 1UL), PAGE_SIZE);
+	foo_max_size = foo_nr_pages << PAGE_SHIFT;
+	err = -ENOMEM;
+	foo_pages = kvcalloc(foo_nr_pages, sizeof(*foo_pages), GFP_KERNEL);
+	if (!foo_pages)
+		goto out;
+	/*
+	 * Unlike debugfs_create_file(), this doesn't wrap foo_fops in a proxy
+	 * that has no mmap().  Nothing stops an open file outliving its dentry,
+	 * but the files are only removed on unload, and foo_fops.owner keeps
+	 * us loaded while foo is open or mapped.
+	 */
+	err = -ENODEV;
+	if (!debugfs_create_file_unsafe("foo", 0644, eudyptula_dentry, NULL,
+					&foo_fops))
+		goto out;
+
 	return 0;
+
+out:
+	/* as on unload, the files go first, so none of them outlive us */
+	debugfs_remove_recursive(eudyptula_dentry);
+	if (foo_pages)
+		foo_free();
+	del_timer_sync(&clock_timer);
+	free_page((unsigned long)clock_page);
+	return err;
 }
 
 static void debugfs_exit(void)
 {
 	debugfs_remove_recursive(eudyptula_dentry);
-	free_page((unsigned long)foo_buf);
+	foo_free();
+	del_timer_sync(&clock_timer);
+	free_page((unsigned long)clock_page);
 	pr_alert("debugfs module exit\n");
 }
 
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Layout of the page that mmap() of /sys/kernel/debug/eudyptula/clock gives.
+ */
+#ifndef _EUDYPTULA_CLOCK_H
+#define _EUDYPTULA_CLOCK_H
+
+#include <linux/types.h>
+
+/*
+ * Updated every tick while mapped.  seq is odd while an update is under way;
+ * read it, then the clock, then seq again, and retry if it changed or was
+ * odd, with read barriers in between.
+ */
+struct eudyptula_clock {
+	__u32 seq;
+	__u32 __pad;
+	__u64 jiffies;
+	__u64 ktime_ns; /* CLOCK_MONOTONIC, as of the last tick */
+};
+
+#endif /* _EUDYPTULA_CLOCK_H */
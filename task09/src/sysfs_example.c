@@ -14,153 +14,227 @@
 #include <linux/slab.h>
 #include <linux/mutex.h>
 #include <linux/stat.h>
+#include <linux/kobject.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
 #include <asm/page.h>
 
-static ssize_t eudyptula_show(struct kobject *kobj, struct attribute *attr,
-			      char *buf);
-static ssize_t eudyptula_store(struct kobject *kobj, struct attribute *attr,
-			       const char *buf, size_t size);
-static void eudyptula_dev_release(struct kobject *kobj);
+static unsigned int foo_max = 64 * 1024;
+module_param(foo_max, uint, 0444);
+MODULE_PARM_DESC(foo_max, "Most foo can hold, rounded up to a page (default: 64KiB)");
 
 struct eudyptula_dev {
 	struct mutex foo_mut;
-	void *foo_buf;
-	ssize_t foo_size;
+	void *foo_buf; /* vmalloc_user(), so it can be mapped */
+	size_t foo_size;
 	struct kobject kobj;
 };
 
 static struct eudyptula_dev *eudyptula_dev;
 
-static struct attribute id_attr = {
-	.name = "id",
-	.mode = S_IRUGO | S_IWUGO,
-};
-static struct attribute jiffies_attr = {
-	.name = "jiffies",
-	.mode = S_IRUGO,
-};
-static struct attribute foo_attr = {
-	.name = "foo",
-	.mode = S_IRUGO | S_IWUSR,
-};
-
-static const struct sysfs_ops eudyptula_ops = {
-	.show = eudyptula_show,
-	.store = eudyptula_store,
-};
-
-static struct attribute *eudyptula_attrs[] = {
-	&id_attr,
-	&jiffies_attr,
-	&foo_attr,
-	NULL,
-};
-
-static struct kobj_type eudyptula_ktype = {
-	.release = eudyptula_dev_release,
-	.sysfs_ops = &eudyptula_ops,
-	.default_attrs = eudyptula_attrs,
-};
+static struct eudyptula_dev *to_eudyptula_dev(struct kobject *kobj)
+{
+	return container_of(kobj, struct eudyptula_dev, kobj);
+}
 
 static const char id[] = "voidstarfoobar";
-static ssize_t id_show(char *buf)
+static ssize_t id_show(struct kobject *kobj, struct kobj_attribute *attr,
+		       char *buf)
 {
 	int data_len = ARRAY_SIZE(id) - 1;
 	memcpy(buf, id, data_len);
 	return data_len;
 }
 
-static ssize_t id_store(const char *buf, size_t size)
+static ssize_t id_store(struct kobject *kobj, struct kobj_attribute *attr,
+			const char *buf, size_t size)
 {
 	if (size == strlen(id) || strncmp(buf, id, size))
 		return -EINVAL;
 	return size;
 }
 
+/* __ATTR() won't have a world writable file, so it's spelled out */
+static struct kobj_attribute id_attr = {
+	.attr = { .name = "id", .mode = S_IRUGO | S_IWUGO },
+	.show = id_show,
+	.store = id_store,
+};
+
 #define MAX_JIF_STR (2 + (2 * sizeof(jiffies)) + 1 + 1)
-static ssize_t jiffies_show(char *buf)
+static ssize_t jiffies_show(struct kobject *kobj, struct kobj_attribute *attr,
+			    char *buf)
 {
 	unsigned long current_jif = jiffies;
 	return snprintf(buf, MAX_JIF_STR, "%#lx\n", current_jif);
 }
 
-static ssize_t foo_show(char *buf)
-{
-	if (mutex_lock_interruptible(&eudyptula_dev->foo_mut))
-		return -ERESTARTSYS;
-	memcpy(buf, eudyptula_dev->foo_buf, eudyptula_dev->foo_size);
-	mutex_unlock(&eudyptula_dev->foo_mut);
-	return eudyptula_dev->foo_size;
-}
+static struct kobj_attribute jiffies_attr = __ATTR_RO(jiffies);
 
-static ssize_t foo_store(const char *buf, size_t size)
+/*
+ * foo is a binary attribute, so reads and writes come with an offset and only
+ * the part asked for is copied, and it can be mmap()ed for no copies at all.
+ * A write at offset 0 replaces the contents, and later ones (the rest of the
+ * same write(), or further writes) add to them.  Anything past the end of
+ * the contents is kept zeroed.
+ *
+ * Mapping foo makes the whole range mapped part of the contents, as if it
+ * had been written, so whatever is stored through the mapping can be read
+ * back.  A later write at offset 0 cuts it off again like any other.
+ *
+ * Writes that change the contents wake anyone waiting in poll() or select()
+ * on the file (for POLLPRI or exceptional conditions), who should then seek
+ * back and read it again.  Changes made through a mapping don't.
+ */
+static ssize_t foo_read(struct file *file, struct kobject *kobj,
+			struct bin_attribute *attr, char *buf, loff_t pos,
+			size_t count)
 {
-	if (mutex_lock_interruptible(&eudyptula_dev->foo_mut))
+	struct eudyptula_dev *dev = to_eudyptula_dev(kobj);
+
+	if (mutex_lock_interruptible(&dev->foo_mut))
 		return -ERESTARTSYS;
-	memcpy(eudyptula_dev->foo_buf, buf, size);
-	eudyptula_dev->foo_size = size;
-	mutex_unlock(&eudyptula_dev->foo_mut);
-	return size;
+	if (pos >= dev->foo_size)
+		count = 0;
+	else
+		count = min_t(size_t, count, dev->foo_size - pos);
+	memcpy(buf, dev->foo_buf + pos, count);
+	mutex_unlock(&dev->foo_mut);
+
+	return count;
 }
 
-static ssize_t eudyptula_show(struct kobject *kobj, struct attribute *attr,
-			      char *buf)
+static ssize_t foo_write(struct file *file, struct kobject *kobj,
+			 struct bin_attribute *attr, char *buf, loff_t pos,
+			 size_t count)
 {
-	if (attr->name == id_attr.name)
-		return id_show(buf);
-	else if (attr->name == jiffies_attr.name)
-		return jiffies_show(buf);
-	else if (attr->name == foo_attr.name)
-		return foo_show(buf);
+	struct eudyptula_dev *dev = to_eudyptula_dev(kobj);
+	size_t size;
+	bool changed;
+
+	if (mutex_lock_interruptible(&dev->foo_mut))
+		return -ERESTARTSYS;
+	if (!pos)
+		size = count;
 	else
-		return -EINVAL;
+		size = max_t(size_t, dev->foo_size, pos + count);
+	changed = size != dev->foo_size ||
+		  memcmp(dev->foo_buf + pos, buf, count);
+	/* past the end must stay zeroed, mappings included */
+	if (size < dev->foo_size)
+		memset(dev->foo_buf + size, 0, dev->foo_size - size);
+	if (pos > dev->foo_size)
+		memset(dev->foo_buf + dev->foo_size, 0, pos - dev->foo_size);
+	memcpy(dev->foo_buf + pos, buf, count);
+	dev->foo_size = size;
+	mutex_unlock(&dev->foo_mut);
+
+	if (changed)
+		sysfs_notify(kobj, NULL, attr->attr.name);
+
+	return count;
 }
 
-static ssize_t eudyptula_store(struct kobject *kobj, struct attribute *attr,
-			       const char *buf, size_t size)
+/*
+ * sysfs doesn't check the mapping against attr->size, but
+ * remap_vmalloc_range() won't map past the end of foo_buf.
+ */
+static int foo_mmap(struct file *file, struct kobject *kobj,
+		    struct bin_attribute *attr, struct vm_area_struct *vma)
 {
-	if (attr->name == id_attr.name)
-		return id_store(buf, size);
-	else if (attr->name == jiffies_attr.name)
-		return -EPERM;
-	else if (attr->name == foo_attr.name)
-		return foo_store(buf, size);
-	else
-		return -EINVAL;
+	struct eudyptula_dev *dev = to_eudyptula_dev(kobj);
+	size_t end = (vma->vm_pgoff << PAGE_SHIFT) +
+		     (vma->vm_end - vma->vm_start);
+	bool grown = false;
+	int err;
+
+	err = remap_vmalloc_range(vma, dev->foo_buf, vma->vm_pgoff);
+	if (err)
+		return err;
+
+	mutex_lock(&dev->foo_mut);
+	if (end > dev->foo_size) {
+		dev->foo_size = end;
+		grown = true;
+	}
+	mutex_unlock(&dev->foo_mut);
+
+	if (grown)
+		sysfs_notify(kobj, NULL, attr->attr.name);
+
+	return 0;
 }
 
+static struct bin_attribute foo_attr = {
+	.attr = { .name = "foo", .mode = S_IRUGO | S_IWUSR },
+	.read = foo_read,
+	.write = foo_write,
+	.mmap = foo_mmap,
+};
+
+static struct attribute *eudyptula_attrs[] = {
+	&id_attr.attr,
+	&jiffies_attr.attr,
+	NULL,
+};
+
+static struct bin_attribute *eudyptula_bin_attrs[] = {
+	&foo_attr,
+	NULL,
+};
+
+static const struct attribute_group eudyptula_group = {
+	.attrs = eudyptula_attrs,
+	.bin_attrs = eudyptula_bin_attrs,
+};
+
 static void eudyptula_dev_release(struct kobject *kobj)
 {
-	struct eudyptula_dev *dev =
-		container_of(kobj, struct eudyptula_dev, kobj);
-	free_page((unsigned long)dev->foo_buf);
+	struct eudyptula_dev *dev = to_eudyptula_dev(kobj);
+
+	vfree(dev->foo_buf);
 	kfree(dev);
 }
 
+static struct kobj_type eudyptula_ktype = {
+	.release = eudyptula_dev_release,
+	.sysfs_ops = &kobj_sysfs_ops,
+};
+
 static int eudyptula_init(void)
 {
 	int retval;
 
-	eudyptula_dev = kmalloc(sizeof(struct eudyptula_dev), GFP_KERNEL);
-	eudyptula_dev->foo_buf = (void *)get_zeroed_page(GFP_KERNEL);
+	eudyptula_dev = kzalloc(sizeof(struct eudyptula_dev), GFP_KERNEL);
+	if (!eudyptula_dev)
+		return -ENOMEM;
+	foo_attr.size = PAGE_ALIGN(max(foo_max, 1U));
+	eudyptula_dev->foo_buf = vmalloc_user(foo_attr.size);
 	if (!eudyptula_dev->foo_buf) {
+		kfree(eudyptula_dev);
 		return -ENOMEM;
 	}
-	eudyptula_dev->foo_size = 0;
 	mutex_init(&eudyptula_dev->foo_mut);
-	kobject_init(&eudyptula_dev->kobj, &eudyptula_ktype);
 
-	retval = kobject_add(&eudyptula_dev->kobj, NULL, "eudyptula");
-	if (retval) {
-		kobject_put(&eudyptula_dev->kobj);
-		return retval;
-	}
+	retval = kobject_init_and_add(&eudyptula_dev->kobj, &eudyptula_ktype,
+				      kernel_kobj, "eudyptula");
+	if (retval)
+		goto out;
+	retval = sysfs_create_group(&eudyptula_dev->kobj, &eudyptula_group);
+	if (retval)
+		goto out;
 
 	return 0;
+
+out:
+	kobject_put(&eudyptula_dev->kobj);
+	return retval;
 }
 
 static void eudyptula_exit(void)
 {
+	sysfs_remove_group(&eudyptula_dev->kobj, &eudyptula_group);
 	kobject_put(&eudyptula_dev->kobj);
 }
 
@@ -7,9 +7,18 @@
 #include <linux/module.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/xarray.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/sched.h>
 
 MODULE_LICENSE("Dual BSD/GPL");
 
+static unsigned int bench_ids;
+module_param(bench_ids, uint, 0444);
+MODULE_PARM_DESC(bench_ids,
+		 "Number of ids to create, find and destroy at load time (default: 0, off)");
+
 struct identity {
 	char name[20];
 	int id;
@@ -17,7 +26,12 @@ struct identity {
 	struct list_head list_member;
 };
 
+/*
+ * The list keeps insertion order, the xarray indexes the same entries by id so
+ * that lookups and removals don't have to walk the list.
+ */
 static LIST_HEAD(identities);
+static DEFINE_XARRAY(identities_by_id);
 
 static struct kmem_cache *identity_cache;
 
@@ -25,6 +39,7 @@ int identity_create(char *name, int id)
 {
 	struct identity *new =
 		kmem_cache_alloc(identity_cache, GFP_KERNEL);
+	int err;
 
 	if (!new)
 		return -ENOMEM;
@@ -33,6 +48,11 @@ int identity_create(char *name, int id)
 	new->id = id;
 	new->busy = false;
 
+	err = xa_insert(&identities_by_id, id, new, GFP_KERNEL);
+	if (err) {
+		kmem_cache_free(identity_cache, new);
+		return err; /* -EBUSY if the id is taken */
+	}
 	list_add(&(new->list_member), &identities);
 
 	return 0;
@@ -40,26 +60,60 @@ int identity_create(char *name, int id)
 
 struct identity *identity_find(int id)
 {
-	struct identity *entry;
+	return xa_load(&identities_by_id, id);
+}
 
-	list_for_each_entry (entry, &identities, list_member) {
-		if (entry->id == id)
-			return entry;
-	}
+void identity_destroy(int id)
+{
+	struct identity *entry = xa_erase(&identities_by_id, id);
 
-	return NULL;
+	if (entry) {
+		list_del(&(entry->list_member));
+		kmem_cache_free(identity_cache, entry);
+	}
 }
 
-void identity_destroy(int id)
+static void identity_bench(void)
 {
-	struct identity *entry, *next;
+	u64 start, create_ns, find_ns, destroy_ns;
+	unsigned int i, n, found = 0;
+
+	if (!bench_ids)
+		return;
+
+	start = ktime_get_ns();
+	for (n = 0; n < bench_ids; n++) {
+		if (identity_create("bench", n))
+			break;
+		if (!(n % 1024))
+			cond_resched();
+	}
+	create_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+	for (i = 0; i < n; i++) {
+		if (identity_find(i))
+			found++;
+		if (!(i % 1024))
+			cond_resched();
+	}
+	find_ns = ktime_get_ns() - start;
 
-	list_for_each_entry_safe (entry, next, &identities, list_member) {
-		if (entry->id == id) {
-			list_del(&(entry->list_member));
-			kmem_cache_free(identity_cache, entry);
-		}
+	start = ktime_get_ns();
+	for (i = 0; i < n; i++) {
+		identity_destroy(i);
+		if (!(i % 1024))
+			cond_resched();
 	}
+	destroy_ns = ktime_get_ns() - start;
+
+	if (n < bench_ids)
+		pr_info("bench: only created %u of %u ids\n", n, bench_ids);
+	if (!n)
+		return;
+	pr_info("bench: %u ids (%u found): create %llu ns (%llu ns/id), find %llu ns (%llu ns/id), destroy %llu ns (%llu ns/id)\n",
+		n, found, create_ns, div_u64(create_ns, n), find_ns,
+		div_u64(find_ns, n), destroy_ns, div_u64(destroy_ns, n));
 }
 
 static int slab_example_init(void)
@@ -89,6 +143,8 @@ static int slab_example_init(void)
 	identity_destroy(42);
 	identity_destroy(3);
 
+	identity_bench();
+
 	return 0;
 }
 
@@ -0,0 +1,78 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "eudyptula_ring.h"
+
+#define ASSERT(expr)                                                           \
+	if (!(expr)) {                                                         \
+		fprintf(stderr, "Failed assert @ %s:%s():%d\n", __FILE__,      \
+			__func__, __LINE__);                                   \
+		exit(EXIT_FAILURE);                                            \
+	}
+
+#define RING_MASK (EUDYPTULA_RING_ENTRIES - 1)
+
+/*
+ * Submit a few identities through the mmap()ed ring and wait for their
+ * completions.
+ */
+int main(void)
+{
+	static const char *names[] = { "Alice", "Bob", "Dave", "Gena" };
+	const unsigned int n = sizeof(names) / sizeof(names[0]);
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t ring_len = (sizeof(struct eudyptula_ring) + page_size - 1) &
+			  ~(page_size - 1);
+	struct eudyptula_ring *ring;
+	struct eudyptula_sqe *sqe;
+	struct eudyptula_cqe *cqe;
+	struct pollfd pfd;
+	unsigned int i, head, tail, reaped;
+	int fd;
+
+	fd = open("/dev/eudyptula", O_RDWR);
+	ASSERT(fd != -1);
+	ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ASSERT(ring != MAP_FAILED);
+
+	/* Only one ring per open file */
+	ASSERT(mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		    0) == MAP_FAILED);
+
+	/* Submit */
+	tail = ring->sq.tail;
+	for (i = 0; i < n; i++) {
+		sqe = &ring->sqes[tail++ & RING_MASK];
+		strncpy(sqe->name, names[i], sizeof(sqe->name));
+		sqe->user_data = i;
+	}
+	__atomic_store_n(&ring->sq.tail, tail, __ATOMIC_RELEASE);
+	ASSERT(!ioctl(fd, EUDYPTULA_IOC_RING_ENTER));
+
+	/* Reap */
+	head = ring->cq.head;
+	for (reaped = 0; reaped < n;) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		ASSERT(poll(&pfd, 1, 5000) == 1);
+		while (head != __atomic_load_n(&ring->cq.tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head++ & RING_MASK];
+			ASSERT(cqe->user_data < n);
+			printf("%s: id %d\n", names[cqe->user_data], cqe->id);
+			reaped++;
+		}
+		__atomic_store_n(&ring->cq.head, head, __ATOMIC_RELEASE);
+	}
+	ASSERT(__atomic_load_n(&ring->sq.head, __ATOMIC_ACQUIRE) == tail);
+
+	munmap(ring, ring_len);
+	close(fd);
+
+	return 0;
+}
@@ -12,6 +12,27 @@
 #include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/xarray.h>
+#include <linux/uio.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/percpu_counter.h>
+#include <linux/string.h>
+
+#include "eudyptula_ring.h"
+
+#define CREATE_TRACE_POINTS
+#include "eudyptula_trace.h"
 
 #if 0
 #define MY_DEBUG(str, ...)                                              \
@@ -24,138 +45,956 @@
 #define MY_DEBUG(str, ...)
 #endif
 
-#define ID_NAME_BUF_LEN 20
+#define ID_NAME_BUF_LEN EUDYPTULA_NAME_LEN
+#define RING_MASK (EUDYPTULA_RING_ENTRIES - 1)
+
+static unsigned int nr_workers = 1;
+module_param(nr_workers, uint, 0444);
+MODULE_PARM_DESC(nr_workers,
+		 "Number of consumer kthreads, capped at the number of CPUs (default: 1)");
+
+static unsigned int drain_batch = 1;
+module_param(drain_batch, uint, 0644);
+MODULE_PARM_DESC(drain_batch,
+		 "Max identities consumed per worker wakeup (default: 1)");
+
+static unsigned int drain_interval_ms = 500;
+module_param(drain_interval_ms, uint, 0644);
+MODULE_PARM_DESC(drain_interval_ms,
+		 "Pause after each batch when drain_rate is 0 (default: 500)");
+
+static unsigned int drain_rate;
+module_param(drain_rate, uint, 0644);
+MODULE_PARM_DESC(drain_rate,
+		 "Max identities consumed per second per worker, 0 to use drain_interval_ms instead (default: 0)");
+
+static unsigned int capacity = 65536;
+module_param(capacity, uint, 0644);
+MODULE_PARM_DESC(capacity,
+		 "Max identities waiting to be consumed, 0 for no limit (default: 65536)");
+
+enum overflow_policy {
+	OVERFLOW_BLOCK,
+	OVERFLOW_EAGAIN,
+	OVERFLOW_DROP_OLDEST,
+};
+
+static const char *const overflow_policy_names[] = {
+	[OVERFLOW_BLOCK] = "block",
+	[OVERFLOW_EAGAIN] = "eagain",
+	[OVERFLOW_DROP_OLDEST] = "drop-oldest",
+};
+
+static int overflow_policy = OVERFLOW_BLOCK;
+
+static int overflow_policy_set(const char *val, const struct kernel_param *kp)
+{
+	int policy = sysfs_match_string(overflow_policy_names, val);
+
+	if (policy < 0)
+		return policy;
+	WRITE_ONCE(*(int *)kp->arg, policy);
+
+	return 0;
+}
+
+static int overflow_policy_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n",
+		       overflow_policy_names[READ_ONCE(*(int *)kp->arg)]);
+}
 
+static const struct kernel_param_ops overflow_policy_ops = {
+	.set = overflow_policy_set,
+	.get = overflow_policy_get,
+};
+
+module_param_cb(overflow_policy, &overflow_policy_ops, &overflow_policy, 0644);
+MODULE_PARM_DESC(overflow_policy,
+		 "What a write to a full queue does: block, eagain or drop-oldest (default: block)");
+
+/*
+ * Everything the queue touches comes first, so that with the cache's
+ * SLAB_HWCACHE_ALIGN an identity fits (and stays) in a single cache line.
+ */
 struct identity {
-	char name[ID_NAME_BUF_LEN];
+	struct list_head list_member;
+	struct llist_node ingest_member;
+	u64 submit_ns;
 	int id;
 	bool busy;
-	struct list_head list_member;
+	char name[ID_NAME_BUF_LEN];
 };
 
-static DEFINE_MUTEX(identities_lock);
-static LIST_HEAD(identities);
-static int id_counter = 0;
+static struct kmem_cache *identity_cache;
+
+/*
+ * Run once per object when the slab is populated, not on every allocation, so
+ * objects must go back to the cache in this state (hence list_del_init()).
+ */
+static void identity_ctor(void *obj)
+{
+	struct identity *identity = obj;
+
+	INIT_LIST_HEAD(&identity->list_member);
+	identity->busy = false;
+}
 
-static int identity_create(char *name, int id)
+static void identity_free(struct identity *identity)
 {
-	struct identity *new = kmalloc(sizeof(*new), GFP_KERNEL);
+	kmem_cache_free(identity_cache, identity);
+}
+
+/*
+ * Counters are per-CPU and only ever bumped on the local CPU, so keeping them
+ * costs the write path no shared cache lines.  They are summed when read.
+ * Latency is from submission to consumption, with bucket i counting latencies
+ * in [2^i, 2^(i+1)) ns and the last bucket catching everything slower.
+ */
+#define LATENCY_BUCKETS 34 /* up to ~8.6 s */
+
+struct eudyptula_stats {
+	u64 submitted;
+	u64 consumed;
+	u64 dropped;
+	u64 completions_dropped;
+	u64 latency[LATENCY_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct eudyptula_stats, eudyptula_stats);
+
+static void stats_record_latency(u64 latency_ns)
+{
+	unsigned int bucket = latency_ns ? ilog2(latency_ns) : 0;
+
+	this_cpu_inc(eudyptula_stats.latency[min(bucket,
+						  LATENCY_BUCKETS - 1U)]);
+}
+
+/*
+ * Identities are consumed by a pool of workers, each owning the identities
+ * whose id maps to it (id % nr_workers), so everything that happens to one
+ * identity happens on one worker, in order.
+ *
+ * Writers never touch a worker directly.  Each CPU has its own lockless ingest
+ * list that writers push onto, and every CPU has a home worker (cpu %
+ * nr_workers) that empties that list and deals its contents out to the owning
+ * workers.  Writers on different CPUs therefore never share a lock or a cache
+ * line.
+ */
+struct eudyptula_worker {
+	unsigned int index;
+	struct task_struct *task;
+	wait_queue_head_t wee_wait;
+
+	/*
+	 * The list keeps consumption (FIFO) order for this worker's shard.  It
+	 * and this shard's entries in identities_by_id are protected by lock.
+	 */
+	struct mutex lock;
+	struct list_head identities;
+
+	/* home worker scratch space, one list per worker to deal out to */
+	struct list_head *dispatch;
+
+	/* rings assigned to this worker, protected by rings_lock */
+	struct mutex rings_lock;
+	struct list_head rings;
+	atomic_t rings_doorbell;
+	unsigned int rings_turn; /* who gets the odd one, see do_stuff() */
+};
+
+static struct eudyptula_worker *workers;
+
+static DEFINE_PER_CPU(struct llist_head, identities_ingest);
+static DEFINE_XARRAY(identities_by_id);
+static atomic_t id_counter = ATOMIC_INIT(0);
+
+/*
+ * Identities submitted but not yet consumed or dropped.  A percpu_counter
+ * keeps the write path off a shared cache line until the queue nears capacity,
+ * at which point percpu_counter_compare() switches to an exact sum.  Concurrent
+ * writers can still overshoot capacity by the size of their writes in flight.
+ */
+static struct percpu_counter queued;
+
+/* writers blocked on a full queue, woken by the workers as they consume */
+DECLARE_WAIT_QUEUE_HEAD(space_wait);
+
+static bool queue_has_room(unsigned int count)
+{
+	unsigned int cap = READ_ONCE(capacity);
+
+	return !cap || percpu_counter_compare(&queued, (s64)cap - count + 1) < 0;
+}
+
+static struct eudyptula_worker *identity_owner(int id)
+{
+	return &workers[(unsigned int)id % nr_workers];
+}
+
+static struct eudyptula_worker *cpu_home_worker(int cpu)
+{
+	return &workers[cpu % nr_workers];
+}
+
+/*
+ * Processed identities are reported back to readers of the device as
+ * "<id> <name>\n" lines.  Workers are serialised by done_write_lock and
+ * readers by done_read_lock, which is all kfifo needs to go without a lock
+ * between the two sides.
+ */
+#define DONE_FIFO_LEN 4096
+#define DONE_RECORD_LEN (11 + 1 + ID_NAME_BUF_LEN + 1)
+static DEFINE_KFIFO(done_fifo, char, DONE_FIFO_LEN);
+static DEFINE_SPINLOCK(done_write_lock);
+static DEFINE_MUTEX(done_read_lock);
+DECLARE_WAIT_QUEUE_HEAD(done_wait);
+
+/* the id is handed out when the identity is submitted */
+static struct identity *identity_create(char *name)
+{
+	struct identity *new = kmem_cache_alloc(identity_cache, GFP_KERNEL);
 
 	if (!new)
-		return -ENOMEM;
+		return NULL;
 
 	strscpy(new->name, name, sizeof(new->name));
-	new->id = id;
-	new->busy = false;
 
-	list_add(&(new->list_member), &identities);
+	return new;
+}
 
-	return 0;
+/*
+ * A chain of new identities, built privately by one writer and handed over to
+ * the workers in one go.  The chain is kept newest first, the same order an
+ * llist accumulates in, so that it can be treated like any other run of
+ * llist_add()s.
+ */
+struct identity_batch {
+	struct llist_node *first;
+	struct llist_node *last;
+	unsigned int count;
+};
+
+static void identity_batch_add(struct identity_batch *batch,
+			       struct identity *new)
+{
+	new->ingest_member.next = batch->first;
+	batch->first = &new->ingest_member;
+	if (!batch->last)
+		batch->last = &new->ingest_member;
+	batch->count++;
 }
 
-struct identity *identity_find(int id)
+static void identity_batch_free(struct identity_batch *batch)
+{
+	struct identity *entry, *next;
+
+	llist_for_each_entry_safe (entry, next, batch->first, ingest_member)
+		identity_free(entry);
+	batch->first = batch->last = NULL;
+	batch->count = 0;
+}
+
+/*
+ * Number the batch and hand it over to the workers, costing one atomic for the
+ * ids and one for the enqueue no matter how big the batch is.  Wakes this
+ * CPU's home worker if its ingest list was empty beforehand; the home worker
+ * rechecks every list it owns before it goes back to sleep.
+ *
+ * Migrating to another CPU after picking the list is harmless, since
+ * llist_add_batch() is safe against concurrent producers.  It only costs us
+ * some locality.
+ */
+static void identity_batch_submit(struct identity_batch *batch)
 {
 	struct identity *entry;
+	int id = atomic_add_return(batch->count, &id_counter);
+	int cpu = raw_smp_processor_id();
+	u64 now = ktime_get_ns();
 
-	list_for_each_entry (entry, &identities, list_member) {
-		if (entry->id == id)
-			return entry;
+	/* newest first, so hand out ids from the top of our range down */
+	llist_for_each_entry (entry, batch->first, ingest_member) {
+		entry->id = --id;
+		entry->submit_ns = now;
 	}
+	if (trace_eudyptula_submit_enabled()) {
+		llist_for_each_entry (entry, batch->first, ingest_member)
+			trace_eudyptula_submit(entry->id, entry->name);
+	}
+	this_cpu_add(eudyptula_stats.submitted, batch->count);
+	percpu_counter_add(&queued, batch->count);
 
-	return NULL;
+	if (llist_add_batch(batch->first, batch->last,
+			    per_cpu_ptr(&identities_ingest, cpu))) {
+		MY_DEBUG("Finished writing, now waking up home worker");
+		wake_up(&cpu_home_worker(cpu)->wee_wait);
+	}
 }
 
-static void identity_destroy(int id)
+static bool identities_ingest_pending(struct eudyptula_worker *home)
+{
+	int cpu;
+
+	for_each_possible_cpu (cpu) {
+		if (cpu_home_worker(cpu) == home &&
+		    !llist_empty(per_cpu_ptr(&identities_ingest, cpu)))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Deal out every pending submission on @home's CPUs to the owning workers,
+ * keeping per-CPU submission order within each shard.  Each owner's lock is
+ * taken once, however many identities it is given.
+ */
+static void identities_ingest_dispatch(struct eudyptula_worker *home)
 {
+	struct llist_node *batch;
 	struct identity *entry, *next;
+	struct eudyptula_worker *owner;
+	bool dealt = false;
+	unsigned int i;
+	int cpu;
 
-	list_for_each_entry_safe (entry, next, &identities, list_member) {
-		if (entry->id == id) {
-			list_del(&(entry->list_member));
-			kfree(entry);
+	for_each_possible_cpu (cpu) {
+		if (cpu_home_worker(cpu) != home)
+			continue;
+		batch = llist_del_all(per_cpu_ptr(&identities_ingest, cpu));
+		if (!batch)
+			continue;
+		/* llist is LIFO, so flip it back into submission order */
+		batch = llist_reverse_order(batch);
+		llist_for_each_entry_safe (entry, next, batch, ingest_member) {
+			owner = identity_owner(entry->id);
+			list_add_tail(&entry->list_member,
+				      &home->dispatch[owner->index]);
 		}
+		dealt = true;
+	}
+	if (!dealt)
+		return;
+
+	for (i = 0; i < nr_workers; i++) {
+		if (list_empty(&home->dispatch[i]))
+			continue;
+		owner = &workers[i];
+		mutex_lock(&owner->lock);
+		list_for_each_entry_safe (entry, next, &home->dispatch[i],
+					  list_member) {
+			if (xa_insert(&identities_by_id, entry->id, entry,
+				      GFP_KERNEL)) {
+				pr_warn_ratelimited("Dropping identity %d, failed to index it\n",
+						    entry->id);
+				trace_eudyptula_drop(entry->id);
+				this_cpu_inc(eudyptula_stats.dropped);
+				percpu_counter_dec(&queued);
+				list_del_init(&entry->list_member);
+				identity_free(entry);
+			}
+		}
+		list_splice_tail_init(&home->dispatch[i], &owner->identities);
+		mutex_unlock(&owner->lock);
+		if (owner != home)
+			wake_up(&owner->wee_wait);
 	}
 }
 
-static struct identity *identity_get(void)
+struct identity *identity_find(int id)
+{
+	return xa_load(&identities_by_id, id);
+}
+
+/* Must be called with the owning worker's lock held */
+static void identity_destroy(int id)
+{
+	struct identity *entry = xa_erase(&identities_by_id, id);
+
+	if (entry) {
+		list_del_init(&(entry->list_member));
+		identity_free(entry);
+	}
+}
+
+static struct identity *identity_get(struct eudyptula_worker *worker)
 {
 	MY_DEBUG("Checking for new identities");
-	if (list_empty(&identities)) {
+	if (list_empty(&worker->identities)) {
 		MY_DEBUG("None found");
 		return NULL;
         }
-	return list_first_entry(&identities, struct identity, list_member);
+	return list_first_entry(&worker->identities, struct identity,
+				list_member);
+}
+
+/*
+ * Drop the oldest identity already dealt out to a worker.  Returns false if
+ * there was none.
+ */
+static bool identity_drop_oldest(void)
+{
+	struct eudyptula_worker *worker, *oldest = NULL;
+	struct identity *head;
+	int oldest_id = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr_workers; i++) {
+		worker = &workers[i];
+		mutex_lock(&worker->lock);
+		head = identity_get(worker);
+		/* ids wrap, so compare them the way jiffies are compared */
+		if (head && (!oldest || head->id - oldest_id < 0)) {
+			oldest = worker;
+			oldest_id = head->id;
+		}
+		mutex_unlock(&worker->lock);
+	}
+	if (!oldest)
+		return false;
+
+	/* it may have been consumed meanwhile, in which case drop the next */
+	mutex_lock(&oldest->lock);
+	head = identity_get(oldest);
+	if (head) {
+		trace_eudyptula_drop(head->id);
+		this_cpu_inc(eudyptula_stats.dropped);
+		percpu_counter_dec(&queued);
+		identity_destroy(head->id);
+	}
+	mutex_unlock(&oldest->lock);
+
+	return head;
+}
+
+/* Drop all but the newest @keep identities of a not yet submitted batch */
+static void identity_batch_trim(struct identity_batch *batch, unsigned int keep)
+{
+	struct llist_node *rest, *tail = batch->first;
+	struct identity *entry, *next;
+	unsigned int i;
+
+	if (keep >= batch->count)
+		return;
+	if (!keep) {
+		rest = batch->first;
+		batch->first = batch->last = NULL;
+	} else {
+		for (i = 1; i < keep; i++)
+			tail = tail->next;
+		rest = tail->next;
+		tail->next = NULL;
+		batch->last = tail;
+	}
+	this_cpu_add(eudyptula_stats.submitted, batch->count - keep);
+	this_cpu_add(eudyptula_stats.dropped, batch->count - keep);
+	batch->count = keep;
+
+	llist_for_each_entry_safe (entry, next, rest, ingest_member)
+		identity_free(entry);
+}
+
+/*
+ * Make room for @batch under the drop-oldest policy.  Only identities already
+ * dealt out to a worker can be dropped, so if that isn't enough (say the rest
+ * are still on their way to a worker, or the batch alone is over capacity)
+ * the oldest records of the batch itself go instead.
+ */
+static void identities_shed(struct identity_batch *batch)
+{
+	unsigned int cap = READ_ONCE(capacity);
+	s64 excess = percpu_counter_sum(&queued) + batch->count - cap;
+
+	while (excess > 0 && identity_drop_oldest())
+		excess--;
+	if (excess > 0)
+		identity_batch_trim(batch, batch->count > excess ?
+						   batch->count - excess : 0);
+}
+
+/*
+ * Called as a write is parsed, so that one huge write can't pin more than
+ * about capacity identities before it is admitted.  A batch over capacity
+ * would be refused anyway, unless drop-oldest is in force, in which case its
+ * oldest records are shed every time it doubles past capacity.
+ */
+static int identity_batch_bound(struct identity_batch *batch)
+{
+	unsigned int cap = READ_ONCE(capacity);
+
+	if (!cap || batch->count <= cap)
+		return 0;
+	if (READ_ONCE(overflow_policy) != OVERFLOW_DROP_OLDEST)
+		return -EFBIG;
+	if (batch->count - cap >= cap)
+		identity_batch_trim(batch, cap);
+
+	return 0;
+}
+
+/*
+ * Apply the overflow policy to a batch that is about to be submitted.  On
+ * success the batch may have been trimmed (possibly to nothing).
+ */
+static int identity_batch_admit(struct identity_batch *batch, bool nonblock)
+{
+	unsigned int cap = READ_ONCE(capacity);
+	int policy = READ_ONCE(overflow_policy);
+
+	if (queue_has_room(batch->count))
+		return 0;
+	if (policy == OVERFLOW_DROP_OLDEST) {
+		identities_shed(batch);
+		return 0;
+	}
+	if (batch->count > cap)
+		return -EFBIG; /* would never fit */
+	if (policy == OVERFLOW_EAGAIN || nonblock)
+		return -EAGAIN;
+
+	MY_DEBUG("Queue full, waiting for room");
+	if (wait_event_interruptible(space_wait,
+				     queue_has_room(batch->count)))
+		return -ERESTARTSYS;
+
+	return 0;
+}
+
+/*
+ * Report a processed identity to readers.  Nobody has to be reading, so rather
+ * than stall the queue when the fifo is full we drop the record.
+ */
+static void identity_complete(struct identity *identity)
+{
+	char record[DONE_RECORD_LEN];
+	int len = scnprintf(record, sizeof(record), "%d %s\n", identity->id,
+			    identity->name);
+
+	spin_lock(&done_write_lock);
+	if (kfifo_avail(&done_fifo) >= len)
+		kfifo_in(&done_fifo, record, len);
+	else
+		len = 0;
+	spin_unlock(&done_write_lock);
+
+	if (!len) {
+		pr_warn_ratelimited("Completion fifo full, dropping identity %d\n",
+				    identity->id);
+		this_cpu_inc(eudyptula_stats.completions_dropped);
+	}
+}
+
+/*
+ * Per open file state.  The ring is shared with (and so can be scribbled on by)
+ * userspace at any time, so the kernel keeps its own copies of the indices it
+ * owns and only ever publishes them.
+ */
+struct eudyptula_file {
+	struct eudyptula_ring *ring;
+	u32 sq_head;
+	u32 cq_tail;
+	struct eudyptula_worker *worker;
+	struct list_head ring_member;
+};
+
+/* rings are spread over the workers in the order they are mapped */
+static atomic_t rings_mapped = ATOMIC_INIT(0);
+
+/*
+ * Consume up to @budget submissions straight out of the shared ring, posting a
+ * completion for each.  Stops early if the completion ring is full.  Returns
+ * the number consumed and sets @more if submissions were left behind because
+ * the budget ran out.  Must be called with the worker's rings_lock held.
+ */
+static unsigned int ring_consume(struct eudyptula_file *ef,
+				 unsigned int budget, bool *more)
+{
+	struct eudyptula_ring *ring = ef->ring;
+	u32 sq_tail = smp_load_acquire(&ring->sq.tail);
+	u32 cq_head = smp_load_acquire(&ring->cq.head);
+	struct eudyptula_sqe *sqe;
+	struct eudyptula_cqe *cqe;
+	unsigned int count = 0;
+	int id;
+
+	while (ef->sq_head != sq_tail &&
+	       ef->cq_tail - cq_head < EUDYPTULA_RING_ENTRIES) {
+		if (count == budget) {
+			*more = true;
+			break;
+		}
+		sqe = &ring->sqes[ef->sq_head & RING_MASK];
+		cqe = &ring->cqes[ef->cq_tail & RING_MASK];
+		id = atomic_inc_return(&id_counter) - 1;
+		pr_alert("Identity.name: %.*s\n", ID_NAME_BUF_LEN, sqe->name);
+		pr_alert("Identity.id: %d\n", id);
+		trace_eudyptula_consume(id, sqe->name, 0);
+		cqe->user_data = READ_ONCE(sqe->user_data);
+		cqe->id = id;
+		ef->sq_head++;
+		ef->cq_tail++;
+		count++;
+	}
+	if (count) {
+		/* ring entries skip the queue, so there is no latency to record */
+		this_cpu_add(eudyptula_stats.submitted, count);
+		this_cpu_add(eudyptula_stats.consumed, count);
+		/* hand the sqes back, then publish the filled in cqes */
+		smp_store_release(&ring->sq.head, ef->sq_head);
+		smp_store_release(&ring->cq.tail, ef->cq_tail);
+	}
+
+	return count;
+}
+
+static unsigned int rings_consume(struct eudyptula_worker *worker,
+				  unsigned int budget)
+{
+	struct eudyptula_file *ef;
+	unsigned int count = 0;
+	bool more = false;
+
+	if (!budget || !atomic_xchg(&worker->rings_doorbell, 0))
+		return 0;
+
+	mutex_lock(&worker->rings_lock);
+	list_for_each_entry (ef, &worker->rings, ring_member)
+		count += ring_consume(ef, budget - count, &more);
+	/* so the first ring doesn't always get first go at the budget */
+	if (!list_empty(&worker->rings))
+		list_rotate_left(&worker->rings);
+	mutex_unlock(&worker->rings_lock);
+
+	/*
+	 * Leftovers from a full completion ring wait for userspace to reap and
+	 * ring the doorbell again, but anything we merely ran out of budget
+	 * for is picked up on the next pass.
+	 */
+	if (more)
+		atomic_set(&worker->rings_doorbell, 1);
+
+	return count;
 }
 
-DECLARE_WAIT_QUEUE_HEAD(wee_wait);
-static struct task_struct *eudyptula_kthread;
+/*
+ * Sleep off the cost of a batch of @count identities.  With drain_rate set we
+ * keep a running deadline rather than sleeping a fixed amount per batch, so
+ * that time spent printing and waiting for new work counts towards the budget
+ * and the long term rate holds regardless of batch size.
+ */
+static void drain_pace(struct eudyptula_worker *worker, unsigned int count,
+		       ktime_t *deadline)
+{
+	unsigned int rate = READ_ONCE(drain_rate);
+	ktime_t now = ktime_get();
+	ktime_t timeout;
+
+	if (rate) {
+		if (ktime_before(*deadline, now))
+			*deadline = now;
+		*deadline = ktime_add_ns(*deadline,
+					 div_u64((u64)count * NSEC_PER_SEC, rate));
+		timeout = ktime_sub(*deadline, now);
+	} else {
+		timeout = ms_to_ktime(READ_ONCE(drain_interval_ms));
+	}
+
+	if (ktime_to_ns(timeout) <= 0)
+		return;
+	/* unlike msleep(), this returns early when the module is unloaded */
+	wait_event_interruptible_hrtimeout(worker->wee_wait,
+					   kthread_should_stop(), timeout);
+}
 
 static int do_stuff(void *data)
 {
-	struct identity *next;
+	struct eudyptula_worker *worker = data;
+	LIST_HEAD(batch);
+	struct identity *next, *tmp;
+	unsigned int count, limit, reserve;
+	ktime_t deadline = 0;
+	u64 latency_ns;
 
-	MY_DEBUG("Kthread now running");
+	MY_DEBUG("Worker %u now running", worker->index);
 
 	while (!kthread_should_stop()) {
 		MY_DEBUG("Entering wait...");
-                wait_event_interruptible(wee_wait, kthread_should_stop() || identity_get());
+                wait_event_interruptible(worker->wee_wait,
+					 kthread_should_stop() ||
+					 identity_get(worker) ||
+					 identities_ingest_pending(worker) ||
+					 atomic_read(&worker->rings_doorbell));
 		MY_DEBUG("Woke up!");
-		mutex_lock_interruptible(&identities_lock);
-		if ((next = identity_get())) {
+
+		identities_ingest_dispatch(worker);
+
+		/*
+		 * With rings waiting, half the batch is kept for them, and
+		 * the queue only gets what's left over.  Odd batches (a batch
+		 * of one in particular) give the extra one to each in turn.
+		 */
+		limit = max(READ_ONCE(drain_batch), 1U);
+		reserve = 0;
+		if (atomic_read(&worker->rings_doorbell)) {
+			reserve = (limit + worker->rings_turn) / 2;
+			worker->rings_turn ^= 1;
+		}
+
+		/* take the lock once per batch, not once per identity */
+		count = 0;
+		mutex_lock(&worker->lock);
+		while (count < limit - reserve &&
+		       (next = identity_get(worker))) {
+			xa_erase(&identities_by_id, next->id);
+			list_move_tail(&next->list_member, &batch);
+			count++;
+		}
+		mutex_unlock(&worker->lock);
+
+		if (count) {
+			percpu_counter_sub(&queued, count);
+			if (wq_has_sleeper(&space_wait))
+				wake_up(&space_wait);
+		}
+		list_for_each_entry_safe (next, tmp, &batch, list_member) {
+			latency_ns = ktime_get_ns() - next->submit_ns;
+			stats_record_latency(latency_ns);
+			this_cpu_inc(eudyptula_stats.consumed);
+			trace_eudyptula_consume(next->id, next->name, latency_ns);
 			pr_alert("Identity.name: %s\n", next->name);
 			pr_alert("Identity.id: %d\n", next->id);
-			identity_destroy(next->id);
+			identity_complete(next);
+			list_del_init(&next->list_member);
+			identity_free(next);
+		}
+		count += rings_consume(worker, limit - count);
+		if (count) {
+			wake_up_interruptible(&done_wait);
+			drain_pace(worker, count, &deadline);
 		}
-		mutex_unlock(&identities_lock);
-		if (next)
-			msleep(500);
 	}
 
-	MY_DEBUG("Kthread stopping");
+	MY_DEBUG("Worker %u stopping", worker->index);
 
 	return 0;
 }
 
-static ssize_t eudyptula_write(struct file *file, const char __user *user,
-			       size_t len, loff_t *offset)
+#define WRITE_CHUNK_LEN 256
+
+/*
+ * Each newline-delimited record becomes an identity, so a single write() or
+ * writev() can submit any number of them.  A write without a newline is one
+ * record, as before.  Empty records are skipped and long ones are truncated
+ * silently rather than indicating a partial write.  What happens when the
+ * queue is full is up to overflow_policy, but a write is always either taken
+ * whole or not at all (bar drop-oldest trimming it).  A write with more
+ * records than capacity fails with -EFBIG as soon as that is known.
+ */
+static ssize_t eudyptula_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
+	size_t len = iov_iter_count(from);
+	struct identity_batch batch = { 0 };
+	char chunk[WRITE_CHUNK_LEN];
+	char name[ID_NAME_BUF_LEN];
+	size_t name_len = 0;
+	size_t chunk_len, i;
+	struct identity *new;
 	ssize_t retval;
-	char write_buf[ID_NAME_BUF_LEN] = { 0 };
-	int truncated_len = min(len, (size_t)ID_NAME_BUF_LEN);
 
 	MY_DEBUG("Writing...");
 
-	if (copy_from_user(write_buf, user, truncated_len)) {
-		MY_DEBUG("Failed copy during writing");
-		retval = -EFAULT;
-		goto out;
-	}
-	if (mutex_lock_interruptible(&identities_lock)) {
-		MY_DEBUG("Woken when trying to get lock during write");
-		retval = -ERESTARTSYS;
-		goto out;
+	while (iov_iter_count(from)) {
+		chunk_len = min(iov_iter_count(from), sizeof(chunk));
+		if (copy_from_iter(chunk, chunk_len, from) != chunk_len) {
+			MY_DEBUG("Failed copy during writing");
+			retval = -EFAULT;
+			goto err;
+		}
+		for (i = 0; i <= chunk_len; i++) {
+			/* the end of the whole write also ends a record */
+			if (i == chunk_len && iov_iter_count(from))
+				break;
+			if (i < chunk_len && chunk[i] != '\n') {
+				if (name_len < sizeof(name) - 1)
+					name[name_len++] = chunk[i];
+				continue;
+			}
+			if (!name_len)
+				continue;
+			name[name_len] = '\0';
+			name_len = 0;
+			new = identity_create(name);
+			if (!new) {
+				MY_DEBUG("Failed creating new identity");
+				retval = -ENOMEM;
+				goto err;
+			}
+			identity_batch_add(&batch, new);
+			retval = identity_batch_bound(&batch);
+			if (retval)
+				goto err;
+		}
+		cond_resched();
 	}
-	if (identity_create(write_buf, id_counter++)) {
-		MY_DEBUG("Failed creating new identity");
-		retval = -ENOMEM;
-		goto unlock;
+	if (batch.count) {
+		retval = identity_batch_admit(&batch, iocb->ki_filp->f_flags &
+						      O_NONBLOCK);
+		if (retval)
+			goto err;
 	}
-	*offset += truncated_len;
-	retval = len; /* truncate silently rather than indicate a partial write */
+	iocb->ki_pos += len;
 
-	MY_DEBUG("Finished writing, now waking up kthread");
+	if (batch.count)
+		identity_batch_submit(&batch);
 
-	wake_up(&wee_wait);
+	return len;
 
-unlock:
-	mutex_unlock(&identities_lock);
-out:
+err:
+	identity_batch_free(&batch);
 	return retval;
 }
 
+static int eudyptula_open(struct inode *inode, struct file *file)
+{
+	struct eudyptula_file *ef = kzalloc(sizeof(*ef), GFP_KERNEL);
+
+	if (!ef)
+		return -ENOMEM;
+	file->private_data = ef;
+
+	return 0;
+}
+
+static int eudyptula_release(struct inode *inode, struct file *file)
+{
+	struct eudyptula_file *ef = file->private_data;
+
+	if (ef->ring) {
+		mutex_lock(&ef->worker->rings_lock);
+		list_del(&ef->ring_member);
+		mutex_unlock(&ef->worker->rings_lock);
+		vfree(ef->ring);
+	}
+	kfree(ef);
+
+	return 0;
+}
+
+/*
+ * Map a fresh submission/completion ring pair into userspace.  Each open file
+ * gets at most one, and it lives until the file is released (which can't
+ * happen while it is still mapped).  The ring is served by a single worker, so
+ * its entries complete in submission order.
+ */
+static int eudyptula_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct eudyptula_file *ef = file->private_data;
+	struct eudyptula_worker *worker;
+	struct eudyptula_ring *ring;
+	int ret;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start != PAGE_ALIGN(sizeof(*ring)))
+		return -EINVAL;
+
+	ring = vmalloc_user(sizeof(*ring));
+	if (!ring)
+		return -ENOMEM;
+	ret = remap_vmalloc_range(vma, ring, 0);
+	if (ret) {
+		vfree(ring);
+		return ret;
+	}
+	/* mmap() runs under mmap_lock, but nothing stops two threads racing */
+	if (cmpxchg(&ef->ring, NULL, ring)) {
+		vfree(ring);
+		return -EBUSY;
+	}
+
+	worker = &workers[(unsigned int)atomic_inc_return(&rings_mapped) %
+			  nr_workers];
+	mutex_lock(&worker->rings_lock);
+	ef->worker = worker;
+	list_add_tail(&ef->ring_member, &worker->rings);
+	mutex_unlock(&worker->rings_lock);
+
+	return 0;
+}
+
+static long eudyptula_ioctl(struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct eudyptula_file *ef = file->private_data;
+	struct eudyptula_worker *worker;
+
+	switch (cmd) {
+	case EUDYPTULA_IOC_RING_ENTER:
+		worker = READ_ONCE(ef->worker);
+		if (!worker)
+			return -ENXIO;
+		atomic_set(&worker->rings_doorbell, 1);
+		wake_up(&worker->wee_wait);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static ssize_t eudyptula_read(struct file *file, char __user *user,
+			      size_t len, loff_t *offset)
+{
+	unsigned int copied;
+	int ret;
+
+	if (mutex_lock_interruptible(&done_read_lock))
+		return -ERESTARTSYS;
+	while (kfifo_is_empty(&done_fifo)) {
+		mutex_unlock(&done_read_lock);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(done_wait,
+					     !kfifo_is_empty(&done_fifo)))
+			return -ERESTARTSYS;
+		if (mutex_lock_interruptible(&done_read_lock))
+			return -ERESTARTSYS;
+	}
+	ret = kfifo_to_user(&done_fifo, user, len, &copied);
+	mutex_unlock(&done_read_lock);
+
+	return ret ? ret : copied;
+}
+
+static __poll_t eudyptula_poll(struct file *file, poll_table *wait)
+{
+	struct eudyptula_file *ef = file->private_data;
+	struct eudyptula_ring *ring = READ_ONCE(ef->ring);
+	__poll_t mask = 0;
+
+	poll_wait(file, &done_wait, wait);
+	poll_wait(file, &space_wait, wait);
+	if (READ_ONCE(overflow_policy) == OVERFLOW_DROP_OLDEST ||
+	    queue_has_room(1))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	if (!kfifo_is_empty(&done_fifo))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	/* completions waiting in the ring count as readable too */
+	if (ring && READ_ONCE(ring->cq.head) != READ_ONCE(ef->cq_tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
+
 static struct file_operations eudyptula_fops = {
 	.owner = THIS_MODULE,
-	.write = eudyptula_write,
+	.open = eudyptula_open,
+	.release = eudyptula_release,
+	.read = eudyptula_read,
+	.write_iter = eudyptula_write_iter,
+	.poll = eudyptula_poll,
+	.mmap = eudyptula_mmap,
+	.unlocked_ioctl = eudyptula_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
 static struct miscdevice eudyptuladev = {
@@ -163,28 +1002,163 @@ static struct miscdevice eudyptuladev = {
 	.fops = &eudyptula_fops,
 	.name = "eudyptuladev",
 	.nodename = "eudyptula",
-	.mode = S_IWUGO,
+	.mode = S_IRUGO | S_IWUGO,
 };
 
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct eudyptula_stats sum = { 0 }, *stats;
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu (cpu) {
+		stats = per_cpu_ptr(&eudyptula_stats, cpu);
+		sum.submitted += READ_ONCE(stats->submitted);
+		sum.consumed += READ_ONCE(stats->consumed);
+		sum.dropped += READ_ONCE(stats->dropped);
+		sum.completions_dropped += READ_ONCE(stats->completions_dropped);
+		for (i = 0; i < LATENCY_BUCKETS; i++)
+			sum.latency[i] += READ_ONCE(stats->latency[i]);
+	}
+
+	seq_printf(m, "submitted: %llu\n", sum.submitted);
+	seq_printf(m, "consumed: %llu\n", sum.consumed);
+	seq_printf(m, "dropped: %llu\n", sum.dropped);
+	seq_printf(m, "completions_dropped: %llu\n", sum.completions_dropped);
+	seq_printf(m, "depth: %lld\n", percpu_counter_sum(&queued));
+	seq_puts(m, "latency_ns:\n");
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		if (!sum.latency[i])
+			continue;
+		if (i == LATENCY_BUCKETS - 1)
+			seq_printf(m, "  >= %llu: %llu\n", 1ULL << i,
+				   sum.latency[i]);
+		else
+			seq_printf(m, "  %llu - %llu: %llu\n", i ? 1ULL << i : 0,
+				   (1ULL << (i + 1)) - 1, sum.latency[i]);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static struct dentry *eudyptula_dentry;
+
+static void workers_stop(unsigned int count)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		ret = kthread_stop(workers[i].task);
+		MY_DEBUG("kthread_stop() on worker %u returned %d", i, ret);
+	}
+}
+
+static void workers_free(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_workers; i++)
+		kfree(workers[i].dispatch);
+	kfree(workers);
+}
+
+static int workers_start(void)
+{
+	struct eudyptula_worker *worker;
+	unsigned int i, j;
+	int ret;
+
+	nr_workers = clamp(nr_workers, 1U, nr_cpu_ids);
+	workers = kcalloc(nr_workers, sizeof(*workers), GFP_KERNEL);
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_workers; i++) {
+		worker = &workers[i];
+		worker->index = i;
+		init_waitqueue_head(&worker->wee_wait);
+		mutex_init(&worker->lock);
+		INIT_LIST_HEAD(&worker->identities);
+		mutex_init(&worker->rings_lock);
+		INIT_LIST_HEAD(&worker->rings);
+		atomic_set(&worker->rings_doorbell, 0);
+		worker->dispatch = kcalloc(nr_workers,
+					   sizeof(*worker->dispatch),
+					   GFP_KERNEL);
+		if (!worker->dispatch) {
+			ret = -ENOMEM;
+			goto err;
+		}
+		for (j = 0; j < nr_workers; j++)
+			INIT_LIST_HEAD(&worker->dispatch[j]);
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		worker = &workers[i];
+		worker->task = kthread_run(do_stuff, worker, "eudyptula/%u", i);
+		if (IS_ERR(worker->task)) {
+			MY_DEBUG("Failed to create \"eudyptula\" kthread during module load");
+			ret = PTR_ERR(worker->task); /* -ENOMEM */
+			workers_stop(i);
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	workers_free();
+	return ret;
+}
+
 static int __init eudyptula_init(void)
 {
 	int ret;
 
 	MY_DEBUG("Module loading...");
 
-	eudyptula_kthread = kthread_run(do_stuff, NULL, "eudyptula");
-	if (IS_ERR(eudyptula_kthread)) {
-		MY_DEBUG("Failed to create \"eudyptula\" kthread during module load");
-		return PTR_ERR(eudyptula_kthread); /* -ENOMEM */
+	/*
+	 * Having a constructor also keeps this cache from being merged with
+	 * others, so it gets its own line in /proc/slabinfo.
+	 */
+	identity_cache = kmem_cache_create("eudyptula_identity",
+					   sizeof(struct identity), 0,
+					   SLAB_HWCACHE_ALIGN, identity_ctor);
+	if (!identity_cache) {
+		MY_DEBUG("Failed to create identity cache during module load");
+		return -ENOMEM;
+	}
+
+	ret = percpu_counter_init(&queued, 0, GFP_KERNEL);
+	if (ret) {
+		kmem_cache_destroy(identity_cache);
+		return ret;
+	}
+
+	ret = workers_start();
+	if (ret) {
+		percpu_counter_destroy(&queued);
+		kmem_cache_destroy(identity_cache);
+		return ret;
 	}
 
 	ret = misc_register(&eudyptuladev);
 	if (ret) {
 		MY_DEBUG("Failed to register \"eudyptula\" device during module load");
-		kthread_stop(eudyptula_kthread);
+		workers_stop(nr_workers);
+		workers_free();
+		percpu_counter_destroy(&queued);
+		kmem_cache_destroy(identity_cache);
 		return ret;
 	}
 
+	/* debugfs is only instrumentation, so don't fail the load over it */
+	eudyptula_dentry = debugfs_create_dir("eudyptula", NULL);
+	debugfs_create_file("stats", 0444, eudyptula_dentry, NULL,
+			    &stats_fops);
+
 	MY_DEBUG("Module loaded");
 
 	return 0;
@@ -192,16 +1166,24 @@ static int __init eudyptula_init(void)
 
 static void __exit eudyptula_exit(void)
 {
-	int ret;
 	struct identity *iter;
+	unsigned int i;
 
+	debugfs_remove_recursive(eudyptula_dentry);
 	misc_deregister(&eudyptuladev);
 
-	ret = kthread_stop(eudyptula_kthread);
-	MY_DEBUG("kthread_stop() returned %d", ret);
+	workers_stop(nr_workers);
+
+	for (i = 0; i < nr_workers; i++)
+		identities_ingest_dispatch(&workers[i]);
+	for (i = 0; i < nr_workers; i++) {
+		while ((iter = identity_get(&workers[i])))
+			identity_destroy(iter->id);
+	}
+	workers_free();
 
-	while ((iter = identity_get()))
-		identity_destroy(iter->id);
+	percpu_counter_destroy(&queued);
+	kmem_cache_destroy(identity_cache);
 }
 
 module_init(eudyptula_init);
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Layout of the submission/completion ring pair that /dev/eudyptula exposes
+ * through mmap(), shared between the module and userspace.
+ */
+#ifndef _EUDYPTULA_RING_H
+#define _EUDYPTULA_RING_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define EUDYPTULA_NAME_LEN 20
+#define EUDYPTULA_RING_ENTRIES 256 /* must be a power of two */
+
+/*
+ * The name needn't be NUL terminated.  user_data is handed back untouched in
+ * the matching completion.
+ */
+struct eudyptula_sqe {
+	__u64 user_data;
+	char name[EUDYPTULA_NAME_LEN];
+	__u32 __pad;
+};
+
+struct eudyptula_cqe {
+	__u64 user_data;
+	__s32 id;
+	__u32 __pad;
+};
+
+/*
+ * Free running indices; mask with EUDYPTULA_RING_ENTRIES - 1 to get a slot.
+ * head is only advanced by the consumer of a ring and tail only by its
+ * producer, and each gets its own cache line so the two sides don't bounce it.
+ */
+struct eudyptula_ring_idx {
+	__u32 head;
+	__u8 __pad0[60];
+	__u32 tail;
+	__u8 __pad1[60];
+};
+
+/*
+ * Userspace produces into sqes and consumes from cqes, the module does the
+ * opposite.  mmap() the whole structure (rounded up to a page) at offset 0.
+ */
+struct eudyptula_ring {
+	struct eudyptula_ring_idx sq;
+	struct eudyptula_ring_idx cq;
+	struct eudyptula_sqe sqes[EUDYPTULA_RING_ENTRIES];
+	struct eudyptula_cqe cqes[EUDYPTULA_RING_ENTRIES];
+};
+
+#define EUDYPTULA_IOC_MAGIC 0xE5
+
+/* Doorbell: tell the module there are new entries in the submission ring */
+#define EUDYPTULA_IOC_RING_ENTER _IO(EUDYPTULA_IOC_MAGIC, 0)
+
+#endif /* _EUDYPTULA_RING_H */
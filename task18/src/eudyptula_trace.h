@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM eudyptula
+
+#if !defined(_EUDYPTULA_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EUDYPTULA_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "eudyptula_ring.h"
+
+TRACE_EVENT(eudyptula_submit,
+	TP_PROTO(int id, const char *name),
+	TP_ARGS(id, name),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__array(char, name, EUDYPTULA_NAME_LEN)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		strscpy(__entry->name, name, EUDYPTULA_NAME_LEN);
+	),
+	TP_printk("id=%d name=%s", __entry->id, __entry->name)
+);
+
+TRACE_EVENT(eudyptula_consume,
+	TP_PROTO(int id, const char *name, u64 latency_ns),
+	TP_ARGS(id, name, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, id)
+		__array(char, name, EUDYPTULA_NAME_LEN)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		strscpy(__entry->name, name, EUDYPTULA_NAME_LEN);
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("id=%d name=%s latency_ns=%llu", __entry->id, __entry->name,
+		  __entry->latency_ns)
+);
+
+TRACE_EVENT(eudyptula_drop,
+	TP_PROTO(int id),
+	TP_ARGS(id),
+	TP_STRUCT__entry(
+		__field(int, id)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+	),
+	TP_printk("id=%d", __entry->id)
+);
+
+#endif /* _EUDYPTULA_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE eudyptula_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,96 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "eudyptula_event.h"
+
+#define ASSERT(expr)                                                           \
+	if (!(expr)) {                                                         \
+		fprintf(stderr, "Failed assert @ %s:%s():%d\n", __FILE__,      \
+			__func__, __LINE__);                                   \
+		exit(EXIT_FAILURE);                                            \
+	}
+
+#define RING_MASK (EUDYPTULA_EVENT_RING_ENTRIES - 1)
+
+/* There is a ring for every possible CPU, not just the online ones */
+static unsigned int possible_cpus(void)
+{
+	char buf[256];
+	char *last;
+	ssize_t len;
+	int fd;
+
+	fd = open("/sys/devices/system/cpu/possible", O_RDONLY);
+	ASSERT(fd != -1);
+	len = read(fd, buf, sizeof(buf) - 1);
+	ASSERT(len > 0);
+	close(fd);
+	buf[len] = '\0';
+
+	/* "0-7" or "0,2-5": the highest CPU is the last number in the list */
+	last = buf + strcspn(buf, "\n");
+	while (last > buf && strchr("0123456789", last[-1]))
+		last--;
+
+	return strtoul(last, NULL, 10) + 1;
+}
+
+static void print_event(unsigned int cpu, const struct eudyptula_event *event)
+{
+	char saddr[INET6_ADDRSTRLEN], daddr[INET6_ADDRSTRLEN];
+
+	ASSERT(inet_ntop(event->family, event->saddr, saddr, sizeof(saddr)));
+	ASSERT(inet_ntop(event->family, event->daddr, daddr, sizeof(daddr)));
+	printf("cpu %u: %s %u -> %s %u protocol %u flags 0x%02x", cpu, saddr,
+	       ntohs(event->sport), daddr, ntohs(event->dport),
+	       event->protocol, event->flags);
+	if (event->flags & EUDYPTULA_EVENT_MATCH)
+		printf(" match_offset 0x%x", event->match_offset);
+	printf("\n");
+}
+
+/*
+ * Drain every CPU's ring of packet events through the mmap()ed rings, the way
+ * a binary consumer would, instead of reading them as text.
+ */
+int main(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t stride = (sizeof(struct eudyptula_event_ring) + page_size - 1) &
+			~(page_size - 1);
+	unsigned int cpu, nr_cpus = possible_cpus(), total = 0;
+	struct eudyptula_event_ring *ring;
+	__u32 head, tail;
+	void *rings;
+	int fd;
+
+	fd = open("/sys/kernel/debug/eudyptula/events", O_RDWR);
+	ASSERT(fd != -1);
+	rings = mmap(NULL, nr_cpus * stride, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     fd, 0);
+	ASSERT(rings != MAP_FAILED);
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		ring = (struct eudyptula_event_ring *)((char *)rings +
+						       cpu * stride);
+		head = __atomic_load_n(&ring->hdr.head, __ATOMIC_ACQUIRE);
+		for (tail = ring->hdr.tail; tail != head; tail++, total++)
+			print_event(cpu, &ring->events[tail & RING_MASK]);
+		__atomic_store_n(&ring->hdr.tail, tail, __ATOMIC_RELEASE);
+		if (ring->hdr.dropped)
+			printf("cpu %u: %llu events dropped\n", cpu,
+			       (unsigned long long)ring->hdr.dropped);
+	}
+	printf("%u events\n", total);
+
+	munmap(rings, nr_cpus * stride);
+	close(fd);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Aho-Corasick matcher.  The trie is built with its failure links folded into
+ * the goto function, so scanning never backtracks: one table lookup per byte.
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+
+#include "ac.h"
+
+/* Scratch state that only lives for the duration of ac_build() */
+struct ac_build {
+	u16 *go; /* trie, then DFA, nr_states rows of nr_classes */
+	u16 *fail;
+	u16 *out_link; /* nearest proper suffix state with its own pattern */
+	u16 *order; /* states in BFS order */
+	u16 *renum;
+	int *own_head; /* first pattern ending exactly at a state */
+	int *pattern_next;
+};
+
+static void ac_build_free(struct ac_build *b)
+{
+	kvfree(b->go);
+	kvfree(b->fail);
+	kvfree(b->out_link);
+	kvfree(b->order);
+	kvfree(b->renum);
+	kvfree(b->own_head);
+	kvfree(b->pattern_next);
+}
+
+void ac_free(struct ac_matcher *ac)
+{
+	unsigned int i;
+
+	if (!ac)
+		return;
+	if (ac->patterns)
+		for (i = 0; i < ac->nr_patterns; i++)
+			kfree(ac->patterns[i]);
+	kfree(ac->patterns);
+	kfree(ac->pattern_lens);
+	kvfree(ac->next);
+	kvfree(ac->out_offset);
+	kvfree(ac->out_patterns);
+	kfree(ac);
+}
+
+static int ac_build_trie(struct ac_matcher *ac, struct ac_build *b)
+{
+	unsigned int i, j, states = 1;
+
+	for (i = 0; i < ac->nr_patterns; i++) {
+		const u8 *p = (const u8 *)ac->patterns[i];
+		unsigned int s = 0;
+
+		for (j = 0; j < ac->pattern_lens[i]; j++) {
+			u16 *go = &b->go[s * ac->nr_classes + ac->byte_class[p[j]]];
+
+			if (!*go)
+				*go = states++;
+			s = *go;
+		}
+		b->pattern_next[i] = b->own_head[s];
+		b->own_head[s] = i;
+	}
+	return states;
+}
+
+/*
+ * Breadth first, so a state's failure target is always finished before the
+ * state itself; missing transitions are then copied from it.
+ */
+static void ac_build_dfa(struct ac_matcher *ac, struct ac_build *b)
+{
+	unsigned int ncl = ac->nr_classes;
+	unsigned int head = 0, tail = 0, c;
+
+	b->order[tail++] = 0;
+	while (head < tail) {
+		unsigned int u = b->order[head++];
+
+		for (c = 0; c < ncl; c++) {
+			unsigned int v = b->go[u * ncl + c];
+			unsigned int f;
+
+			if (!v) {
+				if (u)
+					b->go[u * ncl + c] = b->go[b->fail[u] * ncl + c];
+				continue;
+			}
+			f = u ? b->go[b->fail[u] * ncl + c] : 0;
+			b->fail[v] = f;
+			b->out_link[v] = b->own_head[f] >= 0 ? f : b->out_link[f];
+			b->order[tail++] = v;
+		}
+	}
+}
+
+static bool ac_has_output(struct ac_build *b, unsigned int s)
+{
+	return b->own_head[s] >= 0 || b->out_link[s];
+}
+
+static int ac_build_tables(struct ac_matcher *ac, struct ac_build *b,
+			   gfp_t gfp)
+{
+	unsigned int n = ac->nr_states, ncl = ac->nr_classes;
+	unsigned int i, c, id = 0, nr_out = 0, total = 0;
+
+	/* Renumber: states with output last, otherwise keep BFS order */
+	for (i = 0; i < n; i++)
+		if (!ac_has_output(b, b->order[i]))
+			b->renum[b->order[i]] = id++;
+	ac->first_out = id;
+	for (i = 0; i < n; i++)
+		if (ac_has_output(b, b->order[i])) {
+			unsigned int s = b->order[i];
+			int p;
+
+			b->renum[s] = id++;
+			nr_out++;
+			for (; s; s = b->out_link[s])
+				for (p = b->own_head[s]; p >= 0; p = b->pattern_next[p])
+					total++;
+		}
+
+	ac->next = kvmalloc_array(n * ncl, sizeof(*ac->next), gfp);
+	ac->out_offset = kvmalloc_array(nr_out + 1, sizeof(*ac->out_offset),
+					gfp);
+	ac->out_patterns = kvmalloc_array(max(total, 1U),
+					  sizeof(*ac->out_patterns), gfp);
+	if (!ac->next || !ac->out_offset || !ac->out_patterns)
+		return -ENOMEM;
+
+	for (i = 0; i < n; i++)
+		for (c = 0; c < ncl; c++)
+			ac->next[b->renum[i] * ncl + c] = b->renum[b->go[i * ncl + c]];
+
+	/* Output lists, in the new order of the output states */
+	total = 0;
+	for (i = 0; i < n; i++) {
+		unsigned int s = b->order[i];
+		int p;
+
+		if (!ac_has_output(b, s))
+			continue;
+		ac->out_offset[b->renum[s] - ac->first_out] = total;
+		for (; s; s = b->out_link[s])
+			for (p = b->own_head[s]; p >= 0; p = b->pattern_next[p])
+				ac->out_patterns[total++] = p;
+	}
+	ac->out_offset[nr_out] = total;
+	return 0;
+}
+
+struct ac_matcher *ac_build(const char *const *patterns, unsigned int count,
+			    gfp_t gfp)
+{
+	struct ac_build b = {};
+	struct ac_matcher *ac;
+	unsigned int i, j, max_states = 1;
+	int err = -ENOMEM;
+
+	if (!count || count > U16_MAX)
+		return ERR_PTR(-EINVAL);
+
+	ac = kzalloc(sizeof(*ac), gfp);
+	if (!ac)
+		return ERR_PTR(-ENOMEM);
+	ac->nr_patterns = count;
+	ac->patterns = kcalloc(count, sizeof(*ac->patterns), gfp);
+	ac->pattern_lens = kcalloc(count, sizeof(*ac->pattern_lens), gfp);
+	if (!ac->patterns || !ac->pattern_lens)
+		goto out;
+
+	/* Each distinct byte used by a pattern gets a class of its own */
+	ac->nr_classes = 1;
+	for (i = 0; i < count; i++) {
+		size_t len = strlen(patterns[i]);
+
+		err = -EINVAL;
+		if (!len)
+			goto out;
+		err = -E2BIG;
+		max_states += len;
+		if (max_states > AC_MAX_STATES)
+			goto out;
+		err = -ENOMEM;
+		ac->patterns[i] = kstrdup(patterns[i], gfp);
+		if (!ac->patterns[i])
+			goto out;
+		ac->pattern_lens[i] = len;
+		for (j = 0; j < len; j++) {
+			u8 ch = patterns[i][j];
+
+			if (!ac->byte_class[ch])
+				ac->byte_class[ch] = ac->nr_classes++;
+		}
+	}
+
+	b.go = kvcalloc(max_states * ac->nr_classes, sizeof(*b.go), gfp);
+	b.fail = kvcalloc(max_states, sizeof(*b.fail), gfp);
+	b.out_link = kvcalloc(max_states, sizeof(*b.out_link), gfp);
+	b.order = kvcalloc(max_states, sizeof(*b.order), gfp);
+	b.renum = kvcalloc(max_states, sizeof(*b.renum), gfp);
+	b.own_head = kvmalloc_array(max_states, sizeof(*b.own_head), gfp);
+	b.pattern_next = kvmalloc_array(count, sizeof(*b.pattern_next), gfp);
+	if (!b.go || !b.fail || !b.out_link || !b.order || !b.renum ||
+	    !b.own_head || !b.pattern_next)
+		goto out;
+	memset(b.own_head, 0xff, max_states * sizeof(*b.own_head));
+
+	ac->nr_states = ac_build_trie(ac, &b);
+	ac_build_dfa(ac, &b);
+	err = ac_build_tables(ac, &b, gfp);
+	if (err)
+		goto out;
+
+	ac_build_free(&b);
+	return ac;
+out:
+	ac_build_free(&b);
+	ac_free(ac);
+	return ERR_PTR(err);
+}
+
+static void ac_report(const struct ac_matcher *ac, unsigned int state, u32 end,
+		      ac_match_fn fn, void *ctx)
+{
+	unsigned int i = state - ac->first_out;
+	u32 k;
+
+	for (k = ac->out_offset[i]; k < ac->out_offset[i + 1]; k++) {
+		unsigned int p = ac->out_patterns[k];
+
+		fn(ctx, p, end + 1 - ac->pattern_lens[p]);
+	}
+}
+
+void ac_scan(const struct ac_matcher *ac, struct ac_scan *scan, const u8 *data,
+	     unsigned int len, ac_match_fn fn, void *ctx)
+{
+	const u16 *next = ac->next;
+	const u8 *byte_class = ac->byte_class;
+	unsigned int ncl = ac->nr_classes, first_out = ac->first_out;
+	unsigned int state = scan->state;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		state = next[state * ncl + byte_class[data[i]]];
+		if (unlikely(state >= first_out))
+			ac_report(ac, state, scan->pos + i, fn, ctx);
+	}
+	scan->state = state;
+	scan->pos += len;
+}
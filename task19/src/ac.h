@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Aho-Corasick multi-pattern matcher, compiled down to a DFA so that a single
+ * pass over the input finds every occurrence of every pattern.
+ */
+#ifndef _EUDYPTULA_AC_H
+#define _EUDYPTULA_AC_H
+
+#include <linux/types.h>
+#include <linux/gfp.h>
+
+#define AC_MAX_STATES U16_MAX
+
+/*
+ * States are numbered so that every state which completes at least one
+ * pattern comes after every state that doesn't, making "did anything match?"
+ * a single compare per input byte.  Bytes that appear in no pattern all share
+ * byte class 0, so a row of the transition table is only as wide as the
+ * patterns' alphabet.
+ */
+struct ac_matcher {
+	unsigned int nr_states;
+	unsigned int nr_classes;
+	unsigned int first_out; /* first state with output */
+	unsigned int nr_patterns;
+	u32 generation; /* left to the owner, to tell matchers apart */
+	u8 byte_class[256];
+	u16 *next; /* nr_states rows of nr_classes */
+	u32 *out_offset; /* into out_patterns, per output state, plus an end */
+	u16 *out_patterns;
+	char **patterns; /* NUL terminated copies */
+	unsigned int *pattern_lens;
+};
+
+/* A scan in progress, which may be carried across buffers */
+struct ac_scan {
+	u16 state;
+	u32 pos; /* offset of the next byte in the stream */
+};
+
+/*
+ * Called for each match, with the stream offset where it starts (which may
+ * be in an earlier buffer).
+ */
+typedef void (*ac_match_fn)(void *ctx, unsigned int pattern, u32 offset);
+
+struct ac_matcher *ac_build(const char *const *patterns, unsigned int count,
+			    gfp_t gfp);
+void ac_free(struct ac_matcher *ac);
+
+static inline void ac_scan_init(struct ac_scan *scan)
+{
+	scan->state = 0;
+	scan->pos = 0;
+}
+
+void ac_scan(const struct ac_matcher *ac, struct ac_scan *scan, const u8 *data,
+	     unsigned int len, ac_match_fn fn, void *ctx);
+
+#endif /* _EUDYPTULA_AC_H */
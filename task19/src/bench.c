@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Replays synthetic UDP packets through the same parsing, rules and matching
+ * code the hook uses, so the cost per packet can be measured without any
+ * live traffic.  Run by loading the module with bench=1; results go to the
+ * kernel log.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/skbuff.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/if_ether.h>
+#include <linux/netfilter.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/err.h>
+
+#include "eudyptula.h"
+
+static unsigned int bench_packets = 100000;
+module_param(bench_packets, uint, 0444);
+MODULE_PARM_DESC(bench_packets,
+		 "Packets replayed per benchmark run (default: 100000)");
+
+static const unsigned int bench_payload_lens[] = { 64, 512, 1460, 8192 };
+static const unsigned int bench_pattern_counts[] = { 1, 16, 256, 4096 };
+
+#define BENCH_MAX_PATTERNS 4096
+#define BENCH_PATTERN_LEN 8
+#define BENCH_SKBS 64 /* cycled through, so it's not always the same payload */
+
+/* Lowercase letters, so partial matches are common but whole ones rare */
+static void bench_fill(u8 *buf, size_t len)
+{
+	size_t i;
+
+	get_random_bytes(buf, len);
+	for (i = 0; i < len; i++)
+		buf[i] = 'a' + buf[i] % 26;
+}
+
+static struct sk_buff *bench_skb(unsigned int n, unsigned int payload_len,
+				 const char *plant)
+{
+	unsigned int len = sizeof(struct iphdr) + sizeof(struct udphdr) +
+			   payload_len;
+	struct sk_buff *skb;
+	struct iphdr *iph;
+	struct udphdr *udph;
+	u8 *payload;
+
+	skb = alloc_skb(len, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb_reset_network_header(skb);
+	iph = skb_put_zero(skb, sizeof(*iph));
+	iph->version = 4;
+	iph->ihl = sizeof(*iph) / 4;
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->tot_len = htons(len);
+	iph->saddr = htonl(0x0a000001 + n); /* 10.0.0.0/8 */
+	iph->daddr = htonl(0x0a000001);
+
+	skb_set_transport_header(skb, sizeof(*iph));
+	udph = skb_put_zero(skb, sizeof(*udph));
+	udph->source = htons(1024 + n);
+	udph->dest = htons(9);
+	udph->len = htons(sizeof(*udph) + payload_len);
+
+	payload = skb_put(skb, payload_len);
+	bench_fill(payload, payload_len);
+	if (plant)
+		memcpy(payload + (payload_len - strlen(plant)) / 2, plant,
+		       strlen(plant));
+	skb->protocol = htons(ETH_P_IP);
+
+	return skb;
+}
+
+static void bench_run(struct eudyptula_stats __percpu *stats,
+		      const struct ac_matcher *ac, struct sk_buff **skbs,
+		      unsigned int payload_len)
+{
+	struct pkt pkt;
+	u64 start, ns;
+	unsigned int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < bench_packets; i++) {
+		memset(&pkt, 0, sizeof(pkt));
+		local_bh_disable();
+		rcu_read_lock();
+		pkt_inspect(stats, ac, skbs[i % BENCH_SKBS], NFPROTO_IPV4, &pkt);
+		rcu_read_unlock();
+		local_bh_enable();
+		if (!(i % 1024))
+			cond_resched();
+	}
+	ns = max_t(u64, ktime_get_ns() - start, 1);
+
+	pr_info("eudyptula: bench: %u patterns, %u byte payloads: %llu pkts/sec, %llu ns/pkt\n",
+		ac->nr_patterns, payload_len,
+		div64_u64((u64)bench_packets * NSEC_PER_SEC, ns),
+		div64_u64(ns, max(bench_packets, 1U)));
+}
+
+void eudyptula_bench(void)
+{
+	struct ac_matcher *acs[ARRAY_SIZE(bench_pattern_counts)] = { NULL };
+	struct sk_buff *skbs[BENCH_SKBS] = { NULL };
+	struct eudyptula_stats __percpu *stats;
+	char (*patterns)[BENCH_PATTERN_LEN + 1];
+	const char **list;
+	unsigned int i, j, k;
+
+	stats = alloc_percpu(struct eudyptula_stats);
+	patterns = kcalloc(BENCH_MAX_PATTERNS, sizeof(*patterns), GFP_KERNEL);
+	list = kcalloc(BENCH_MAX_PATTERNS, sizeof(*list), GFP_KERNEL);
+	if (!stats || !patterns || !list)
+		goto out;
+
+	for (i = 0; i < BENCH_MAX_PATTERNS; i++) {
+		bench_fill(patterns[i], BENCH_PATTERN_LEN);
+		list[i] = patterns[i];
+	}
+	for (i = 0; i < ARRAY_SIZE(bench_pattern_counts); i++) {
+		acs[i] = ac_build(list, bench_pattern_counts[i], GFP_KERNEL);
+		if (IS_ERR(acs[i])) {
+			pr_err("eudyptula: bench: ac_build() failed with err: %ld",
+			       PTR_ERR(acs[i]));
+			acs[i] = NULL;
+			goto out;
+		}
+	}
+
+	pr_info("eudyptula: bench: replaying %u packets per run\n",
+		bench_packets);
+	for (i = 0; i < ARRAY_SIZE(bench_payload_lens); i++) {
+		/* every fourth packet carries a match */
+		for (j = 0; j < BENCH_SKBS; j++) {
+			skbs[j] = bench_skb(j, bench_payload_lens[i],
+					    j % 4 ? NULL : patterns[0]);
+			if (!skbs[j])
+				goto out;
+		}
+		for (k = 0; k < ARRAY_SIZE(bench_pattern_counts); k++)
+			bench_run(stats, acs[k], skbs, bench_payload_lens[i]);
+		for (j = 0; j < BENCH_SKBS; j++) {
+			kfree_skb(skbs[j]);
+			skbs[j] = NULL;
+		}
+	}
+
+out:
+	for (j = 0; j < BENCH_SKBS; j++)
+		kfree_skb(skbs[j]);
+	for (i = 0; i < ARRAY_SIZE(bench_pattern_counts); i++)
+		ac_free(acs[i]);
+	kfree(list);
+	kfree(patterns);
+	free_percpu(stats);
+}
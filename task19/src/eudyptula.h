@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * What the inspection pipeline in main.c shares with the benchmark.
+ */
+#ifndef _EUDYPTULA_H
+#define _EUDYPTULA_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/skbuff.h>
+#include <linux/icmp.h>
+
+#include "eudyptula_event.h"
+#include "ac.h"
+
+/*
+ * Plain per-CPU counters, one set per network namespace, only ever bumped by
+ * the hook on its own CPU with BHs disabled, and summed when someone reads
+ * them from /proc/net/eudyptula.
+ */
+enum {
+	STATS_TCP,
+	STATS_UDP,
+	STATS_ICMP,
+	STATS_ICMPV6,
+	STATS_OTHER,
+	STATS_PROTOS
+};
+
+struct eudyptula_stats {
+	u64 packets[STATS_PROTOS];
+	u64 bytes[STATS_PROTOS];
+	u64 ipv4;
+	u64 ipv6;
+	u64 icmp_types[NR_ICMP_TYPES + 2]; /* the last is out of range types */
+	u64 scanned; /* packets with a payload that went through the matcher */
+	u64 scanned_bytes;
+	u64 matches;
+	u64 scan_ns;
+	u64 skipped; /* by the rules, also counted above */
+	u64 dropped; /* by match_action */
+	u64 marked;
+	u64 limited; /* over flow_rate, and dropped */
+};
+
+/*
+ * What the hook learns about a packet from its headers.  Both address
+ * families are parsed into this, and everything after that is shared.
+ */
+struct pkt {
+	struct eudyptula_event event;
+	unsigned int payload; /* offset, or 0 if there is nothing to scan */
+	u32 seq; /* TCP only */
+	bool fin; /* TCP FIN or RST, so the flow is finished with */
+	bool limited; /* over its flow's rate */
+	bool report; /* worth an event */
+};
+
+/* Must be called under rcu_read_lock(), with BHs disabled */
+unsigned int pkt_inspect(struct eudyptula_stats __percpu *stats,
+			 const struct ac_matcher *ac, struct sk_buff *skb,
+			 u8 pf, struct pkt *pkt);
+
+void eudyptula_bench(void);
+
+#endif /* _EUDYPTULA_H */
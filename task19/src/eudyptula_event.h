@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Binary packet events, as found in the per-CPU rings that the eudyptula
+ * module exposes through mmap() of /sys/kernel/debug/eudyptula/events
+ * (see events_test/ for a consumer).
+ */
+#ifndef _EUDYPTULA_EVENT_H
+#define _EUDYPTULA_EVENT_H
+
+#include <linux/types.h>
+
+#define EUDYPTULA_EVENT_ICMP (1 << 0) /* icmp_type is valid */
+#define EUDYPTULA_EVENT_MATCH (1 << 1) /* match_offset is valid */
+#define EUDYPTULA_EVENT_STREAM (1 << 2) /* match began in an earlier segment */
+#define EUDYPTULA_EVENT_DROPPED (1 << 3) /* the packet was dropped */
+#define EUDYPTULA_EVENT_LIMITED (1 << 4) /* its flow was over flow_rate */
+#define EUDYPTULA_EVENT_MARKED (1 << 5) /* skb->mark was set */
+
+/*
+ * Addresses and ports are in network byte order.  An IPv4 address only takes
+ * the first word of saddr/daddr, and the rest is zero.
+ */
+struct eudyptula_event {
+	__u64 timestamp_ns; /* CLOCK_MONOTONIC */
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	__u8 family; /* AF_INET or AF_INET6 */
+	__u8 protocol;
+	__u8 icmp_type; /* ICMP or ICMPv6, going by protocol */
+	__u8 flags;
+	__u32 match_offset; /* from the start of the TCP/UDP payload */
+	__u32 netns; /* inode number of the network namespace */
+	__u64 __pad;
+};
+
+#define EUDYPTULA_EVENT_RING_ENTRIES 2048 /* must be a power of two */
+
+/*
+ * Free running indices; mask with EUDYPTULA_EVENT_RING_ENTRIES - 1 to get a
+ * slot.  The kernel advances head and dropped (events lost to a full ring),
+ * the consumer advances tail, and each side gets its own cache line.
+ */
+struct eudyptula_event_ring_hdr {
+	__u32 head;
+	__u32 __pad0;
+	__u64 dropped;
+	__u8 __pad1[48];
+	__u32 tail;
+	__u8 __pad2[60];
+};
+
+/*
+ * There is one ring per possible CPU, each starting on a page boundary: the
+ * ring for CPU n is at offset n * (sizeof(struct eudyptula_event_ring) rounded
+ * up to the page size) in the mapping.
+ */
+struct eudyptula_event_ring {
+	struct eudyptula_event_ring_hdr hdr;
+	struct eudyptula_event events[EUDYPTULA_EVENT_RING_ENTRIES];
+};
+
+#endif /* _EUDYPTULA_EVENT_H */
@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Flows live in a fixed size hash table that packets look up under RCU; the
+ * per-bucket locks are only taken to add or remove a flow.  Idle flows are
+ * aged out by a periodic sweep, and the table stops growing at max_flows,
+ * after which a new flow takes the place of the stalest one in its bucket,
+ * so that a flood of new flows can't keep everyone else out.
+ */
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/log2.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+
+#include "flow.h"
+
+static unsigned int flow_buckets = 4096;
+module_param(flow_buckets, uint, 0444);
+MODULE_PARM_DESC(flow_buckets,
+		 "Size of the flow hash table (rounded up to a power of two)");
+
+static unsigned int max_flows = 65536;
+module_param(max_flows, uint, 0644);
+MODULE_PARM_DESC(max_flows, "Most TCP and UDP flows tracked at once");
+
+static unsigned int flow_timeout = 30;
+module_param(flow_timeout, uint, 0644);
+MODULE_PARM_DESC(flow_timeout, "Seconds of inactivity before a flow is dropped");
+
+struct flow_bucket {
+	struct hlist_head head;
+	spinlock_t lock; /* for writers, lookups are RCU */
+};
+
+static struct flow_bucket *flow_table;
+static unsigned int flow_mask;
+static u32 flow_hash_rnd;
+static atomic_t nr_flows = ATOMIC_INIT(0);
+static struct kmem_cache *flow_cache;
+
+static void flow_gc(struct work_struct *work);
+static DECLARE_DELAYED_WORK(flow_gc_work, flow_gc);
+
+static struct flow_bucket *flow_bucket(const struct flow_key *key)
+{
+	u32 hash = jhash2((const u32 *)key, sizeof(*key) / sizeof(u32),
+			  flow_hash_rnd);
+
+	return &flow_table[hash & flow_mask];
+}
+
+static struct flow *flow_find(struct flow_bucket *b,
+			      const struct flow_key *key)
+{
+	struct flow *flow;
+
+	hlist_for_each_entry_rcu (flow, &b->head, node)
+		if (!memcmp(&flow->key, key, sizeof(*key)))
+			return flow;
+
+	return NULL;
+}
+
+static void flow_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(flow_cache, container_of(head, struct flow, rcu));
+}
+
+/* Caller holds the bucket lock */
+static void flow_unlink(struct flow *flow)
+{
+	if (hlist_unhashed(&flow->node))
+		return; /* already on its way out */
+	hlist_del_init_rcu(&flow->node);
+	atomic_dec(&nr_flows);
+	call_rcu(&flow->rcu, flow_free_rcu);
+}
+
+/* Caller holds the bucket lock */
+static struct flow *flow_stalest(struct flow_bucket *b)
+{
+	struct flow *flow, *stalest = NULL;
+
+	hlist_for_each_entry (flow, &b->head, node)
+		if (!stalest || time_before(READ_ONCE(flow->last_seen),
+					    READ_ONCE(stalest->last_seen)))
+			stalest = flow;
+
+	return stalest;
+}
+
+/*
+ * Returns NULL only if there's no memory, or the table is full and the
+ * flow's bucket has nobody to evict.
+ */
+struct flow *flow_get(const struct flow_key *key, bool create)
+{
+	struct flow_bucket *b = flow_bucket(key);
+	struct flow *flow, *found, *stalest = NULL;
+
+	flow = flow_find(b, key);
+	if (flow || !create)
+		return flow;
+
+	flow = kmem_cache_zalloc(flow_cache, GFP_ATOMIC);
+	if (!flow)
+		return NULL;
+	flow->key = *key;
+	flow->last_seen = jiffies;
+	spin_lock_init(&flow->lock);
+
+	spin_lock(&b->lock);
+	found = flow_find(b, key); /* another CPU may have beaten us to it */
+	if (found)
+		goto out;
+	if (atomic_inc_return(&nr_flows) > READ_ONCE(max_flows)) {
+		atomic_dec(&nr_flows);
+		stalest = flow_stalest(b);
+		if (!stalest)
+			goto out;
+		flow_unlink(stalest);
+		atomic_inc(&nr_flows);
+	}
+	hlist_add_head_rcu(&flow->node, &b->head);
+	spin_unlock(&b->lock);
+
+	return flow;
+out:
+	spin_unlock(&b->lock);
+	kmem_cache_free(flow_cache, flow);
+	return found;
+}
+
+void flow_remove(struct flow *flow)
+{
+	struct flow_bucket *b = flow_bucket(&flow->key);
+
+	spin_lock_bh(&b->lock);
+	flow_unlink(flow);
+	spin_unlock_bh(&b->lock);
+}
+
+static void flow_sweep(unsigned long timeout)
+{
+	struct hlist_node *tmp;
+	struct flow_bucket *b;
+	struct flow *flow;
+	unsigned int i;
+
+	for (i = 0; i <= flow_mask; i++) {
+		b = &flow_table[i];
+		if (hlist_empty(&b->head))
+			continue;
+		spin_lock_bh(&b->lock);
+		hlist_for_each_entry_safe (flow, tmp, &b->head, node)
+			if (time_after_eq(jiffies,
+					  READ_ONCE(flow->last_seen) + timeout))
+				flow_unlink(flow);
+		spin_unlock_bh(&b->lock);
+		cond_resched();
+	}
+}
+
+static void flow_gc(struct work_struct *work)
+{
+	flow_sweep(READ_ONCE(flow_timeout) * HZ);
+	schedule_delayed_work(&flow_gc_work, HZ);
+}
+
+int flow_table_init(void)
+{
+	unsigned int i, size = roundup_pow_of_two(max(flow_buckets, 1U));
+
+	flow_cache = kmem_cache_create("eudyptula_flow", sizeof(struct flow),
+				       0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!flow_cache)
+		return -ENOMEM;
+	flow_table = kvmalloc_array(size, sizeof(*flow_table), GFP_KERNEL);
+	if (!flow_table) {
+		kmem_cache_destroy(flow_cache);
+		return -ENOMEM;
+	}
+	for (i = 0; i < size; i++) {
+		INIT_HLIST_HEAD(&flow_table[i].head);
+		spin_lock_init(&flow_table[i].lock);
+	}
+	flow_mask = size - 1;
+	get_random_bytes(&flow_hash_rnd, sizeof(flow_hash_rnd));
+	schedule_delayed_work(&flow_gc_work, HZ);
+
+	return 0;
+}
+
+/* Only once nothing can be looking flows up any more */
+void flow_table_exit(void)
+{
+	cancel_delayed_work_sync(&flow_gc_work);
+	flow_sweep(0);
+	rcu_barrier();
+	kvfree(flow_table);
+	kmem_cache_destroy(flow_cache);
+}
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Table of TCP and UDP flows.  TCP flows carry the matcher's state from one
+ * segment to the next, so that signatures split across segments still match,
+ * and any flow can carry a token bucket for flow_rate.
+ */
+#ifndef _EUDYPTULA_FLOW_H
+#define _EUDYPTULA_FLOW_H
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/rculist.h>
+
+#include "ac.h"
+
+struct flow_key {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	u32 netns;
+	u8 family;
+	u8 protocol;
+	u8 __pad[2];
+};
+
+/* Tokens are kept as nanoseconds of credit, see flow_police() */
+struct token_bucket {
+	u64 credit_ns;
+	u64 stamp_ns;
+};
+
+struct flow {
+	struct hlist_node node;
+	struct flow_key key;
+	unsigned long last_seen; /* jiffies */
+	spinlock_t lock; /* protects everything below */
+	u32 generation; /* of the matcher that scan belongs to */
+	u32 next_seq;
+	struct ac_scan scan;
+	struct token_bucket tb; /* for flow_rate */
+	struct rcu_head rcu;
+};
+
+/* Must be called under rcu_read_lock(), with BHs disabled */
+struct flow *flow_get(const struct flow_key *key, bool create);
+void flow_remove(struct flow *flow);
+
+int flow_table_init(void);
+void flow_table_exit(void);
+
+#endif /* _EUDYPTULA_FLOW_H */
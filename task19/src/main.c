@@ -0,0 +1,1053 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter_ipv6.h>
+
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+#include <linux/tcp.h>
+#include <linux/icmp.h>
+#include <linux/icmpv6.h>
+#include <net/ipv6.h>
+
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+#include <linux/proc_fs.h>
+
+#include <linux/skbuff.h>
+
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/uaccess.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+
+#include "eudyptula_event.h"
+#include "ac.h"
+#include "flow.h"
+#include "rules.h"
+#include "eudyptula.h"
+
+#if 1
+#define MY_DEBUG(str, ...)                                                     \
+	pr_alert("%s:%s():%d: " str "\n", THIS_MODULE->name, __func__,         \
+		 __LINE__, ##__VA_ARGS__)
+#else
+#define MY_DEBUG(str, ...)
+#endif
+
+static const char *id_str = "eudyptula";
+
+/*
+ * The hook runs under rcu_read_lock(), so a new matcher is built off to the
+ * side and swapped in without the hook ever waiting or being detached; the
+ * old one is freed once no packet can still be using it.
+ */
+static struct ac_matcher __rcu *matcher;
+static DEFINE_MUTEX(matcher_lock);
+static u32 matcher_generation;
+
+static void matcher_replace(struct ac_matcher *new)
+{
+	struct ac_matcher *old;
+
+	mutex_lock(&matcher_lock);
+	if (new)
+		new->generation = ++matcher_generation;
+	old = rcu_replace_pointer(matcher, new, lockdep_is_held(&matcher_lock));
+	mutex_unlock(&matcher_lock);
+	if (old) {
+		synchronize_rcu();
+		ac_free(old);
+	}
+}
+
+/* A comma separated list, e.g. "penguin,tux" */
+static int patterns_set(const char *val, const struct kernel_param *kp)
+{
+	struct ac_matcher *new;
+	const char **list;
+	char *buf, *p, *tok;
+	unsigned int count = 1, i = 0;
+
+	buf = kstrdup(val, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	p = strim(buf);
+	for (tok = p; *tok; tok++)
+		if (*tok == ',')
+			count++;
+	list = kcalloc(count, sizeof(*list), GFP_KERNEL);
+	if (!list) {
+		kfree(buf);
+		return -ENOMEM;
+	}
+	while ((tok = strsep(&p, ",")))
+		list[i++] = tok;
+
+	new = ac_build(list, count, GFP_KERNEL);
+	kfree(list);
+	kfree(buf);
+	if (IS_ERR(new))
+		return PTR_ERR(new);
+	matcher_replace(new);
+
+	return 0;
+}
+
+static int patterns_get(char *buf, const struct kernel_param *kp)
+{
+	struct ac_matcher *ac;
+	unsigned int i;
+	int n = 0;
+
+	mutex_lock(&matcher_lock);
+	ac = rcu_dereference_protected(matcher, lockdep_is_held(&matcher_lock));
+	for (i = 0; ac && i < ac->nr_patterns; i++)
+		n += scnprintf(buf + n, PAGE_SIZE - n, "%s%s", i ? "," : "",
+			       ac->patterns[i]);
+	mutex_unlock(&matcher_lock);
+	n += scnprintf(buf + n, PAGE_SIZE - n, "\n");
+
+	return n;
+}
+
+static const struct kernel_param_ops patterns_ops = {
+	.set = patterns_set,
+	.get = patterns_get,
+};
+module_param_cb(patterns, &patterns_ops, NULL, 0644);
+MODULE_PARM_DESC(patterns,
+		 "Comma separated strings to search packets for (default: \"eudyptula\")");
+
+struct scan_result {
+	unsigned int matches;
+	u32 base; /* stream offset of this packet's payload */
+	s32 first_offset; /* negative if it began in an earlier segment */
+};
+
+static void scan_match(void *ctx, unsigned int pattern, u32 offset)
+{
+	struct scan_result *res = ctx;
+	s32 rel = offset - res->base;
+
+	if (!res->matches++ || rel < res->first_offset)
+		res->first_offset = rel;
+}
+
+/* Feed [from, to) of the skb through the matcher without linearising it */
+static void scan_skb(const struct ac_matcher *ac, struct sk_buff *skb,
+		     unsigned int from, unsigned int to, struct ac_scan *scan,
+		     struct scan_result *res)
+{
+	struct skb_seq_state st;
+	unsigned int consumed = 0, len;
+	const u8 *data;
+
+	res->base = scan->pos;
+	skb_prepare_seq_read(skb, from, to, &st);
+	while ((len = skb_seq_read(consumed, &data, &st)) != 0) {
+		ac_scan(ac, scan, data, len, scan_match, res);
+		consumed += len;
+	}
+}
+
+/*
+ * Packets are reported as fixed size binary events written into per-CPU rings
+ * rather than logged, which would serialise every CPU on printk.  The hook
+ * only ever writes to its own CPU's ring, and runs with BHs disabled, so
+ * producers need no locking.  The rings live in one vmalloc_user() area so
+ * that userspace can mmap() them all at once, and the kernel keeps its own
+ * copies of the indices it owns rather than trusting the shared pages.
+ */
+#define EVENT_RING_MASK (EUDYPTULA_EVENT_RING_ENTRIES - 1)
+#define EVENT_RING_STRIDE PAGE_ALIGN(sizeof(struct eudyptula_event_ring))
+
+static void *event_rings;
+static DEFINE_PER_CPU(u32, event_head);
+static DEFINE_PER_CPU(u64, event_dropped);
+
+static struct eudyptula_event_ring *event_ring(int cpu)
+{
+	return event_rings + cpu * EVENT_RING_STRIDE;
+}
+
+static void event_emit(const struct eudyptula_event *event)
+{
+	struct eudyptula_event_ring *ring = event_ring(smp_processor_id());
+	u32 head = __this_cpu_read(event_head);
+
+	if (head - smp_load_acquire(&ring->hdr.tail) >=
+	    EUDYPTULA_EVENT_RING_ENTRIES) {
+		WRITE_ONCE(ring->hdr.dropped, __this_cpu_inc_return(event_dropped));
+		return;
+	}
+	ring->events[head & EVENT_RING_MASK] = *event;
+	__this_cpu_write(event_head, ++head);
+	smp_store_release(&ring->hdr.head, head);
+}
+
+static const char *icmp_type_name(u8 type)
+{
+	switch (type) {
+	case ICMP_ECHOREPLY:
+		return "Echo Reply";
+	case ICMP_DEST_UNREACH:
+		return "Destination Unreachable";
+	case ICMP_SOURCE_QUENCH:
+		return "Source Quench";
+	case ICMP_REDIRECT:
+		return "Redirect (change route)";
+	case ICMP_ECHO:
+		return "Echo Request";
+	case ICMP_TIME_EXCEEDED:
+		return "Time Exceeded";
+	case ICMP_PARAMETERPROB:
+		return "Parameter Problem";
+	case ICMP_TIMESTAMP:
+		return "Timestamp Request";
+	case ICMP_TIMESTAMPREPLY:
+		return "Timestamp Reply";
+	case ICMP_INFO_REQUEST:
+		return "Information Request";
+	case ICMP_INFO_REPLY:
+		return "Information Reply";
+	case ICMP_ADDRESS:
+		return "Address Mask Request";
+	case ICMP_ADDRESSREPLY:
+		return "Address Mask Reply";
+	default:
+		return "???";
+	}
+}
+
+#define EVENT_LINE_LEN 256
+
+static int event_format(char *buf, size_t len,
+			const struct eudyptula_event *event)
+{
+	int n;
+
+	if (event->family == AF_INET6)
+		n = scnprintf(buf, len,
+			      "IPv6 packet src: [%pI6c]:%u  dest: [%pI6c]:%u  protocol: %u",
+			      event->saddr, ntohs(event->sport), event->daddr,
+			      ntohs(event->dport), event->protocol);
+	else
+		n = scnprintf(buf, len,
+			      "IPv4 packet src: %pI4:%u  dest: %pI4:%u  protocol: %u",
+			      event->saddr, ntohs(event->sport), event->daddr,
+			      ntohs(event->dport), event->protocol);
+	switch (event->protocol) {
+	case IPPROTO_ICMP:
+		n += scnprintf(buf + n, len - n, " (ICMP: %s)",
+			       (event->flags & EUDYPTULA_EVENT_ICMP) ?
+				       icmp_type_name(event->icmp_type) :
+				       "???");
+		break;
+	case IPPROTO_ICMPV6:
+		if (event->flags & EUDYPTULA_EVENT_ICMP)
+			n += scnprintf(buf + n, len - n, " (ICMPv6: type %u)",
+				       event->icmp_type);
+		else
+			n += scnprintf(buf + n, len - n, " (ICMPv6: ???)");
+		break;
+	case IPPROTO_TCP:
+		n += scnprintf(buf + n, len - n, " (TCP)");
+		break;
+	case IPPROTO_UDP:
+		n += scnprintf(buf + n, len - n, " (UDP)");
+		break;
+	default:
+		n += scnprintf(buf + n, len - n, " (???)");
+	}
+	if (event->flags & EUDYPTULA_EVENT_STREAM)
+		n += scnprintf(buf + n, len - n,
+			       ", pattern found spanning an earlier segment");
+	else if (event->flags & EUDYPTULA_EVENT_MATCH)
+		n += scnprintf(buf + n, len - n,
+			       ", pattern found at payload offset 0x%x",
+			       event->match_offset);
+	if (event->flags & EUDYPTULA_EVENT_LIMITED)
+		n += scnprintf(buf + n, len - n, ", over the flow rate");
+	if (event->flags & EUDYPTULA_EVENT_DROPPED)
+		n += scnprintf(buf + n, len - n, ", dropped");
+	if (event->flags & EUDYPTULA_EVENT_MARKED)
+		n += scnprintf(buf + n, len - n, ", marked");
+	n += scnprintf(buf + n, len - n, "  netns: %u\n", event->netns);
+
+	return n;
+}
+
+static DEFINE_MUTEX(events_read_lock);
+
+/*
+ * Drain the rings as text, one line per event, taking only whole lines.  This
+ * consumes the events, so it shouldn't be mixed with an mmap() consumer.
+ */
+static ssize_t events_read(struct file *file, char __user *user, size_t len,
+			   loff_t *offset)
+{
+	struct eudyptula_event_ring *ring;
+	struct eudyptula_event event;
+	char line[EVENT_LINE_LEN];
+	size_t copied = 0;
+	u32 head = 0, tail = 0;
+	int cpu, n;
+
+	if (mutex_lock_interruptible(&events_read_lock))
+		return -ERESTARTSYS;
+	for_each_possible_cpu (cpu) {
+		ring = event_ring(cpu);
+		head = smp_load_acquire(&ring->hdr.head);
+		tail = READ_ONCE(ring->hdr.tail);
+		for (; tail != head; tail++) {
+			event = ring->events[tail & EVENT_RING_MASK];
+			n = event_format(line, sizeof(line), &event);
+			if (n > len - copied)
+				break;
+			if (copy_to_user(user + copied, line, n)) {
+				smp_store_release(&ring->hdr.tail, tail);
+				mutex_unlock(&events_read_lock);
+				return copied ? copied : -EFAULT;
+			}
+			copied += n;
+		}
+		smp_store_release(&ring->hdr.tail, tail);
+		if (tail != head)
+			break; /* out of room */
+	}
+	mutex_unlock(&events_read_lock);
+	if (!copied && tail != head)
+		return -EINVAL; /* too small for even one line */
+	*offset += copied;
+
+	return copied;
+}
+
+static int events_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	return remap_vmalloc_range(vma, event_rings, vma->vm_pgoff);
+}
+
+static const struct file_operations events_fops = {
+	.owner = THIS_MODULE,
+	.read = events_read,
+	.mmap = events_mmap,
+};
+
+static struct dentry *eudyptula_dentry;
+
+/*
+ * Rules are replaced as a whole table, by writing them all at once to
+ * debugfs eudyptula/rules, and read by the hook under RCU.
+ */
+static struct rule_table __rcu *rules;
+static DEFINE_MUTEX(rules_lock);
+
+#define RULES_WRITE_MAX (64 * 1024)
+
+static int default_policy = RULE_INSPECT;
+
+static int default_policy_set(const char *val, const struct kernel_param *kp)
+{
+	int policy = __sysfs_match_string(rule_action_names, RULE_ACTIONS, val);
+
+	if (policy < 0)
+		return policy;
+	WRITE_ONCE(*(int *)kp->arg, policy);
+
+	return 0;
+}
+
+static int default_policy_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n",
+		       rule_action_names[READ_ONCE(*(int *)kp->arg)]);
+}
+
+static const struct kernel_param_ops default_policy_ops = {
+	.set = default_policy_set,
+	.get = default_policy_get,
+};
+
+module_param_cb(default_policy, &default_policy_ops, &default_policy, 0644);
+MODULE_PARM_DESC(default_policy,
+		 "What happens to packets no rule matches: inspect or skip (default: inspect)");
+
+static void rules_replace(struct rule_table *new)
+{
+	struct rule_table *old;
+
+	mutex_lock(&rules_lock);
+	old = rcu_replace_pointer(rules, new, lockdep_is_held(&rules_lock));
+	mutex_unlock(&rules_lock);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+static int rules_seq_show(struct seq_file *m, void *v)
+{
+	rcu_read_lock();
+	rules_show(m, rcu_dereference(rules));
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static int rules_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rules_seq_show, NULL);
+}
+
+static ssize_t rules_write(struct file *file, const char __user *user,
+			   size_t len, loff_t *offset)
+{
+	struct rule_table *table;
+	char *buf;
+
+	if (len > RULES_WRITE_MAX)
+		return -E2BIG;
+	buf = memdup_user_nul(user, len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	table = rules_parse(buf);
+	kfree(buf);
+	if (IS_ERR(table))
+		return PTR_ERR(table);
+	rules_replace(table);
+
+	return len;
+}
+
+static const struct file_operations rules_fops = {
+	.open = rules_open,
+	.read = seq_read,
+	.write = rules_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const char *const stats_proto_names[STATS_PROTOS] = {
+	[STATS_TCP] = "tcp",
+	[STATS_UDP] = "udp",
+	[STATS_ICMP] = "icmp",
+	[STATS_ICMPV6] = "icmpv6",
+	[STATS_OTHER] = "other",
+};
+
+struct eudyptula_net {
+	struct eudyptula_stats __percpu *stats;
+};
+
+static unsigned int eudyptula_net_id __read_mostly;
+
+static unsigned int stats_proto(u8 protocol)
+{
+	switch (protocol) {
+	case IPPROTO_TCP:
+		return STATS_TCP;
+	case IPPROTO_UDP:
+		return STATS_UDP;
+	case IPPROTO_ICMP:
+		return STATS_ICMP;
+	case IPPROTO_ICMPV6:
+		return STATS_ICMPV6;
+	default:
+		return STATS_OTHER;
+	}
+}
+
+static void stats_record(struct eudyptula_stats __percpu *pcpu,
+			 const struct eudyptula_event *event, unsigned int len)
+{
+	struct eudyptula_stats *stats = this_cpu_ptr(pcpu);
+	unsigned int proto = stats_proto(event->protocol);
+
+	if (event->family == AF_INET6)
+		stats->ipv6++;
+	else
+		stats->ipv4++;
+	stats->packets[proto]++;
+	stats->bytes[proto] += len;
+	if (proto == STATS_ICMP && (event->flags & EUDYPTULA_EVENT_ICMP))
+		stats->icmp_types[min_t(unsigned int, event->icmp_type,
+					NR_ICMP_TYPES + 1)]++;
+}
+
+static void stats_record_skip(struct eudyptula_stats __percpu *pcpu)
+{
+	this_cpu_ptr(pcpu)->skipped++;
+}
+
+static void stats_record_scan(struct eudyptula_stats __percpu *pcpu,
+			      unsigned int len, unsigned int matches, u64 ns)
+{
+	struct eudyptula_stats *stats = this_cpu_ptr(pcpu);
+
+	stats->scanned++;
+	stats->scanned_bytes += len;
+	stats->matches += matches;
+	stats->scan_ns += ns;
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct eudyptula_net *en = net_generic(seq_file_single_net(m),
+					       eudyptula_net_id);
+	struct eudyptula_stats sum = { 0 }, *stats;
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu (cpu) {
+		stats = per_cpu_ptr(en->stats, cpu);
+		sum.ipv4 += READ_ONCE(stats->ipv4);
+		sum.ipv6 += READ_ONCE(stats->ipv6);
+		for (i = 0; i < STATS_PROTOS; i++) {
+			sum.packets[i] += READ_ONCE(stats->packets[i]);
+			sum.bytes[i] += READ_ONCE(stats->bytes[i]);
+		}
+		for (i = 0; i < ARRAY_SIZE(sum.icmp_types); i++)
+			sum.icmp_types[i] += READ_ONCE(stats->icmp_types[i]);
+		sum.scanned += READ_ONCE(stats->scanned);
+		sum.scanned_bytes += READ_ONCE(stats->scanned_bytes);
+		sum.matches += READ_ONCE(stats->matches);
+		sum.scan_ns += READ_ONCE(stats->scan_ns);
+		sum.skipped += READ_ONCE(stats->skipped);
+		sum.dropped += READ_ONCE(stats->dropped);
+		sum.marked += READ_ONCE(stats->marked);
+		sum.limited += READ_ONCE(stats->limited);
+	}
+
+	seq_printf(m, "ipv4: %llu packets\n", sum.ipv4);
+	seq_printf(m, "ipv6: %llu packets\n", sum.ipv6);
+	for (i = 0; i < STATS_PROTOS; i++)
+		seq_printf(m, "%s: %llu packets, %llu bytes\n",
+			   stats_proto_names[i], sum.packets[i], sum.bytes[i]);
+	seq_printf(m, "skipped: %llu\n", sum.skipped);
+	seq_puts(m, "icmp_types:\n");
+	for (i = 0; i <= NR_ICMP_TYPES; i++)
+		if (sum.icmp_types[i])
+			seq_printf(m, "  %u (%s): %llu\n", i, icmp_type_name(i),
+				   sum.icmp_types[i]);
+	if (sum.icmp_types[NR_ICMP_TYPES + 1])
+		seq_printf(m, "  >%u (out of range): %llu\n", NR_ICMP_TYPES,
+			   sum.icmp_types[NR_ICMP_TYPES + 1]);
+	seq_printf(m, "scanned: %llu packets, %llu bytes\n", sum.scanned,
+		   sum.scanned_bytes);
+	seq_printf(m, "matches: %llu\n", sum.matches);
+	seq_printf(m, "dropped: %llu\n", sum.dropped);
+	seq_printf(m, "marked: %llu\n", sum.marked);
+	seq_printf(m, "limited: %llu\n", sum.limited);
+	seq_printf(m, "scan_ns: %llu\n", sum.scan_ns);
+	if (sum.scanned)
+		seq_printf(m, "scan_ns_per_packet: %llu\n",
+			   div64_u64(sum.scan_ns, sum.scanned));
+
+	return 0;
+}
+
+/*
+ * The transport header may be short or split across fragments, so it's read
+ * with skb_header_pointer().
+ */
+static void pkt_parse_l4(struct sk_buff *skb, unsigned int thoff,
+			 struct pkt *pkt)
+{
+	struct eudyptula_event *event = &pkt->event;
+	unsigned int payload = 0;
+	struct icmphdr _icmph;
+	const struct icmphdr *icmph;
+	struct tcphdr _tcph;
+	const struct tcphdr *tcph;
+	struct udphdr _udph;
+	const struct udphdr *udph;
+
+	switch (event->protocol) {
+	case IPPROTO_UDP:
+		udph = skb_header_pointer(skb, thoff, sizeof(_udph), &_udph);
+		if (!udph)
+			break;
+		event->sport = udph->source;
+		event->dport = udph->dest;
+		payload = thoff + sizeof(*udph);
+		break;
+	case IPPROTO_TCP:
+		tcph = skb_header_pointer(skb, thoff, sizeof(_tcph), &_tcph);
+		if (!tcph || tcph->doff * 4 < sizeof(*tcph))
+			break;
+		event->sport = tcph->source;
+		event->dport = tcph->dest;
+		payload = thoff + tcph->doff * 4;
+		pkt->seq = ntohl(tcph->seq);
+		pkt->fin = tcph->fin || tcph->rst;
+		break;
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		/* the type is the first byte of both */
+		icmph = skb_header_pointer(skb, thoff, sizeof(_icmph), &_icmph);
+		if (!icmph)
+			break;
+		event->icmp_type = icmph->type;
+		event->flags |= EUDYPTULA_EVENT_ICMP;
+		break;
+	}
+
+	if (payload < skb->len)
+		pkt->payload = payload;
+}
+
+/* ip_rcv() has already validated ihl and pulled the IP header */
+static void pkt_parse_ipv4(struct sk_buff *skb, struct pkt *pkt)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+
+	pkt->event.family = AF_INET;
+	pkt->event.saddr[0] = iph->saddr;
+	pkt->event.daddr[0] = iph->daddr;
+	pkt->event.protocol = iph->protocol;
+	if (iph->frag_off & htons(IP_OFFSET))
+		return; /* no transport header in this one */
+
+	pkt_parse_l4(skb, skb_network_offset(skb) + ip_hdrlen(skb), pkt);
+}
+
+/* ipv6_rcv() has pulled the fixed header, extension headers are up to us */
+static void pkt_parse_ipv6(struct sk_buff *skb, struct pkt *pkt)
+{
+	const struct ipv6hdr *ip6h = ipv6_hdr(skb);
+	u8 nexthdr = ip6h->nexthdr;
+	__be16 frag_off;
+	int thoff;
+
+	pkt->event.family = AF_INET6;
+	memcpy(pkt->event.saddr, &ip6h->saddr, sizeof(ip6h->saddr));
+	memcpy(pkt->event.daddr, &ip6h->daddr, sizeof(ip6h->daddr));
+	thoff = ipv6_skip_exthdr(skb, skb_network_offset(skb) + sizeof(*ip6h),
+				 &nexthdr, &frag_off);
+	pkt->event.protocol = nexthdr;
+	if (thoff < 0 || (frag_off & htons(~0x7)))
+		return; /* no transport header in this one */
+
+	pkt_parse_l4(skb, thoff, pkt);
+}
+
+enum match_action {
+	MATCH_LOG,
+	MATCH_SAMPLE,
+	MATCH_DROP,
+	MATCH_MARK,
+};
+
+static const char *const match_action_names[] = {
+	[MATCH_LOG] = "log",
+	[MATCH_SAMPLE] = "sample",
+	[MATCH_DROP] = "drop",
+	[MATCH_MARK] = "mark",
+};
+
+static int match_action = MATCH_LOG;
+
+static int match_action_set(const char *val, const struct kernel_param *kp)
+{
+	int action = sysfs_match_string(match_action_names, val);
+
+	if (action < 0)
+		return action;
+	WRITE_ONCE(*(int *)kp->arg, action);
+
+	return 0;
+}
+
+static int match_action_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n",
+		       match_action_names[READ_ONCE(*(int *)kp->arg)]);
+}
+
+static const struct kernel_param_ops match_action_ops = {
+	.set = match_action_set,
+	.get = match_action_get,
+};
+
+module_param_cb(match_action, &match_action_ops, &match_action, 0644);
+MODULE_PARM_DESC(match_action,
+		 "What happens to matching packets: log (report every packet), sample (report only matches), drop or mark (default: log)");
+
+static unsigned int mark_value = 1;
+module_param(mark_value, uint, 0644);
+MODULE_PARM_DESC(mark_value, "skb->mark set on matches by match_action=mark (default: 1)");
+
+static unsigned int flow_rate;
+module_param(flow_rate, uint, 0644);
+MODULE_PARM_DESC(flow_rate,
+		 "Packets per second allowed per flow before the rest are dropped, 0 for no limit (default: 0)");
+
+static unsigned int flow_burst = 32;
+module_param(flow_burst, uint, 0644);
+MODULE_PARM_DESC(flow_burst, "Packets a flow may send at once above flow_rate (default: 32)");
+
+/*
+ * Token bucket, with the tokens kept as nanoseconds of credit so refilling
+ * is just adding the time since the last packet.  A new bucket starts full.
+ * @now is taken before the bucket's lock, so another CPU may already have
+ * moved the bucket past it; there's nothing to refill then.
+ */
+static bool flow_police(struct token_bucket *tb, u64 now, unsigned int rate)
+{
+	u64 cost = div_u64(NSEC_PER_SEC, rate);
+	u64 cap = cost * max(READ_ONCE(flow_burst), 1U);
+
+	if (now > tb->stamp_ns) {
+		tb->credit_ns = min(cap, tb->credit_ns + (now - tb->stamp_ns));
+		tb->stamp_ns = now;
+	}
+	if (tb->credit_ns < cost)
+		return false;
+	tb->credit_ns -= cost;
+
+	return true;
+}
+
+/*
+ * Flows the table can't take (no memory, or it's full and there was nothing
+ * to evict) share one bucket per CPU, rather than going unpoliced.  BHs are
+ * off in the hook, so that's all the locking it needs.
+ */
+static DEFINE_PER_CPU(struct token_bucket, overflow_tb);
+
+/*
+ * TCP flows carry the matcher's state from one in-order segment to the next,
+ * so signatures split across segments are still found.  On a gap,
+ * retransmit or pattern reload the scan starts over at this segment, so each
+ * packet still costs one pass over its own payload and no more.  With
+ * rate limiting on, UDP is tracked too, only for its token bucket, and every
+ * packet then takes its flow's lock.
+ */
+static void pkt_scan_flow(const struct ac_matcher *ac, struct sk_buff *skb,
+			  struct pkt *pkt, struct scan_result *res,
+			  unsigned int rate)
+{
+	struct flow_key key = {
+		.sport = pkt->event.sport,
+		.dport = pkt->event.dport,
+		.netns = pkt->event.netns,
+		.family = pkt->event.family,
+		.protocol = pkt->event.protocol,
+	};
+	bool stream = pkt->event.protocol == IPPROTO_TCP;
+	struct ac_scan scan;
+	struct flow *flow;
+
+	memcpy(key.saddr, pkt->event.saddr, sizeof(key.saddr));
+	memcpy(key.daddr, pkt->event.daddr, sizeof(key.daddr));
+	ac_scan_init(&scan);
+	flow = flow_get(&key, pkt->payload || rate);
+	if (!flow && rate &&
+	    !flow_police(this_cpu_ptr(&overflow_tb), pkt->event.timestamp_ns,
+			 rate)) {
+		pkt->limited = true;
+		return;
+	}
+	if (!flow) {
+		if (pkt->payload) /* not tracked, so on its own */
+			scan_skb(ac, skb, pkt->payload, skb->len, &scan, res);
+		return;
+	}
+
+	spin_lock(&flow->lock);
+	if (rate && !flow_police(&flow->tb, pkt->event.timestamp_ns, rate)) {
+		pkt->limited = true; /* not worth scanning, it's going */
+	} else if (pkt->payload && stream) {
+		if (flow->generation != ac->generation ||
+		    flow->next_seq != pkt->seq) {
+			flow->generation = ac->generation;
+			ac_scan_init(&flow->scan);
+		}
+		scan_skb(ac, skb, pkt->payload, skb->len, &flow->scan, res);
+		flow->next_seq = pkt->seq + skb->len - pkt->payload;
+	} else if (pkt->payload) {
+		scan_skb(ac, skb, pkt->payload, skb->len, &scan, res);
+	}
+	WRITE_ONCE(flow->last_seen, jiffies);
+	spin_unlock(&flow->lock);
+
+	/*
+	 * A closed flow would come straight back with a full bucket, so a
+	 * flood setting FIN or RST on every segment would never be limited.
+	 * While policing, flows only go when they age out.
+	 */
+	if (pkt->fin && !rate)
+		flow_remove(flow);
+}
+
+/*
+ * Everything the hook does to a packet short of reporting it, returning the
+ * verdict.  pkt->report says whether it's worth an event.  The caller fills
+ * in pkt->event.netns.
+ */
+unsigned int pkt_inspect(struct eudyptula_stats __percpu *stats,
+			 const struct ac_matcher *ac, struct sk_buff *skb,
+			 u8 pf, struct pkt *pkt)
+{
+	unsigned int rate = READ_ONCE(flow_rate);
+	unsigned int verdict = NF_ACCEPT;
+	struct scan_result res = { 0 };
+	struct ac_scan scan;
+	int action;
+	u64 start;
+
+	if (pf == NFPROTO_IPV6)
+		pkt_parse_ipv6(skb, pkt);
+	else
+		pkt_parse_ipv4(skb, pkt);
+	stats_record(stats, &pkt->event, skb->len);
+	if (rules_action(rcu_dereference(rules), &pkt->event,
+			 READ_ONCE(default_policy)) == RULE_SKIP) {
+		stats_record_skip(stats);
+		return NF_ACCEPT;
+	}
+
+	pkt->event.timestamp_ns = ktime_get_ns();
+	start = pkt->event.timestamp_ns;
+	if (pkt->event.protocol == IPPROTO_TCP ||
+	    (rate && pkt->event.protocol == IPPROTO_UDP)) {
+		pkt_scan_flow(ac, skb, pkt, &res, rate);
+	} else if (pkt->payload) {
+		ac_scan_init(&scan);
+		scan_skb(ac, skb, pkt->payload, skb->len, &scan, &res);
+	}
+	if (pkt->payload && !pkt->limited)
+		stats_record_scan(stats, skb->len - pkt->payload, res.matches,
+				  ktime_get_ns() - start);
+
+	if (pkt->limited) {
+		pkt->event.flags |= EUDYPTULA_EVENT_LIMITED |
+				    EUDYPTULA_EVENT_DROPPED;
+		this_cpu_ptr(stats)->limited++;
+		pkt->report = true;
+		return NF_DROP;
+	}
+
+	action = READ_ONCE(match_action);
+	pkt->report = action == MATCH_LOG || res.matches;
+	if (!res.matches)
+		return NF_ACCEPT;
+
+	pkt->event.flags |= EUDYPTULA_EVENT_MATCH;
+	if (res.first_offset < 0)
+		pkt->event.flags |= EUDYPTULA_EVENT_STREAM;
+	else
+		pkt->event.match_offset = res.first_offset;
+	switch (action) {
+	case MATCH_DROP:
+		pkt->event.flags |= EUDYPTULA_EVENT_DROPPED;
+		this_cpu_ptr(stats)->dropped++;
+		verdict = NF_DROP;
+		break;
+	case MATCH_MARK:
+		skb->mark = READ_ONCE(mark_value);
+		pkt->event.flags |= EUDYPTULA_EVENT_MARKED;
+		this_cpu_ptr(stats)->marked++;
+		break;
+	}
+
+	return verdict;
+}
+
+static unsigned int eudyptula_nf_hook_op(void *priv, struct sk_buff *skb,
+					 const struct nf_hook_state *state)
+{
+	struct eudyptula_net *en = net_generic(state->net, eudyptula_net_id);
+	struct pkt pkt = { 0 };
+	unsigned int verdict;
+
+	pkt.event.netns = state->net->ns.inum;
+	verdict = pkt_inspect(en->stats, rcu_dereference(matcher), skb,
+			      state->pf, &pkt);
+	if (pkt.report)
+		event_emit(&pkt.event);
+
+	return verdict;
+}
+
+static const struct nf_hook_ops eudyptula_nf_hook_ops[] = {
+	{
+		.hook = eudyptula_nf_hook_op,
+		.hooknum = NF_INET_PRE_ROUTING,
+		.pf = NFPROTO_IPV4,
+		.priority = NF_IP_PRI_FIRST,
+	},
+	{
+		.hook = eudyptula_nf_hook_op,
+		.hooknum = NF_INET_PRE_ROUTING,
+		.pf = NFPROTO_IPV6,
+		.priority = NF_IP6_PRI_FIRST,
+	},
+};
+
+/*
+ * Every namespace, present and future, gets its own hooks and its own stats
+ * in /proc/net/eudyptula; the matcher, rules, flows and event rings are
+ * shared by all of them.
+ */
+static int __net_init eudyptula_net_init(struct net *net)
+{
+	struct eudyptula_net *en = net_generic(net, eudyptula_net_id);
+	int err;
+
+	en->stats = alloc_percpu(struct eudyptula_stats);
+	if (!en->stats)
+		return -ENOMEM;
+
+	err = -ENOMEM;
+	if (!proc_create_net_single("eudyptula", 0444, net->proc_net,
+				    stats_show, NULL))
+		goto out1;
+
+	err = nf_register_net_hooks(net, eudyptula_nf_hook_ops,
+				    ARRAY_SIZE(eudyptula_nf_hook_ops));
+	if (err) {
+		pr_err("nf_register_net_hooks() failed with err: %d", err);
+		goto out2;
+	}
+
+	return 0;
+
+out2:
+	remove_proc_entry("eudyptula", net->proc_net);
+out1:
+	free_percpu(en->stats);
+	return err;
+}
+
+/*
+ * nf_unregister_net_hooks() doesn't wait for hooks already running, but the
+ * pernet core does synchronize_rcu() between .pre_exit and .exit, so by the
+ * time .exit frees the stats (or unregister_pernet_subsys() returns) no hook
+ * can still be using them.
+ */
+static void __net_exit eudyptula_net_pre_exit(struct net *net)
+{
+	nf_unregister_net_hooks(net, eudyptula_nf_hook_ops,
+				ARRAY_SIZE(eudyptula_nf_hook_ops));
+}
+
+static void __net_exit eudyptula_net_exit(struct net *net)
+{
+	struct eudyptula_net *en = net_generic(net, eudyptula_net_id);
+
+	remove_proc_entry("eudyptula", net->proc_net);
+	free_percpu(en->stats);
+}
+
+static struct pernet_operations eudyptula_net_ops = {
+	.init = eudyptula_net_init,
+	.pre_exit = eudyptula_net_pre_exit,
+	.exit = eudyptula_net_exit,
+	.id = &eudyptula_net_id,
+	.size = sizeof(struct eudyptula_net),
+};
+
+static bool bench;
+module_param(bench, bool, 0444);
+MODULE_PARM_DESC(bench, "Benchmark the matcher on synthetic packets when loaded");
+
+static int __init eudyptula_init(void)
+{
+	int err;
+
+	MY_DEBUG("Module loading...");
+
+	/* unless patterns= was given on load */
+	if (!rcu_access_pointer(matcher)) {
+		struct ac_matcher *ac = ac_build(&id_str, 1, GFP_KERNEL);
+
+		if (IS_ERR(ac)) {
+			err = PTR_ERR(ac);
+			pr_err("ac_build() failed with err: %d", err);
+			goto out1;
+		}
+		matcher_replace(ac);
+	}
+
+	event_rings = vmalloc_user(nr_cpu_ids * EVENT_RING_STRIDE);
+	if (!event_rings) {
+		err = -ENOMEM;
+		goto out2;
+	}
+
+	/* debugfs is only how we get events out, so don't fail over it */
+	eudyptula_dentry = debugfs_create_dir("eudyptula", NULL);
+	/*
+	 * The debugfs proxy fops don't pass mmap() through, so events goes
+	 * without them.  Its owner keeps us loaded while it's open or mapped,
+	 * which is all the protection it needs, since it only uses event_rings.
+	 */
+	debugfs_create_file_unsafe("events", 0600, eudyptula_dentry, NULL,
+				   &events_fops);
+	debugfs_create_file("rules", 0600, eudyptula_dentry, NULL,
+			    &rules_fops);
+
+	err = flow_table_init();
+	if (err)
+		goto out3;
+
+	if (bench)
+		eudyptula_bench();
+
+	/* only once everything the hooks use is ready */
+	err = register_pernet_subsys(&eudyptula_net_ops);
+	if (err) {
+		pr_err("register_pernet_subsys() failed with err: %d", err);
+		goto out4;
+	}
+
+	MY_DEBUG("Module loaded");
+
+	return 0;
+
+out4:
+	flow_table_exit();
+out3:
+	debugfs_remove_recursive(eudyptula_dentry);
+	rules_replace(NULL);
+	vfree(event_rings);
+out2:
+	matcher_replace(NULL);
+out1:
+	return err;
+}
+
+static void __exit eudyptula_exit(void)
+{
+	/* no hook is still running once this returns, see .pre_exit */
+	unregister_pernet_subsys(&eudyptula_net_ops);
+	flow_table_exit();
+	debugfs_remove_recursive(eudyptula_dentry);
+	rules_replace(NULL);
+	vfree(event_rings);
+	matcher_replace(NULL);
+	MY_DEBUG("Module unloaded");
+}
+
+module_init(eudyptula_init);
+module_exit(eudyptula_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_AUTHOR("Scott J. Crouch");
+MODULE_DESCRIPTION("Example use of netfilter for IPv4 and IPv6 packet inspection");
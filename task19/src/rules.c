@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Rules are written as text, one per line, first match wins:
+ *
+ *   skip|inspect [family ipv4|ipv6] [proto tcp|udp|icmp|<n>]
+ *                [src <addr>[/<len>]] [dst <addr>[/<len>]]
+ *                [sport <lo>[-<hi>]] [dport <lo>[-<hi>]]
+ *
+ * Anything left out matches everything.  Addresses are IPv4 only, and imply
+ * family ipv4.  Blank lines and lines starting with
+ * '#' are ignored.
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/inet.h>
+#include <linux/in.h>
+#include <linux/socket.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+
+#include "rules.h"
+
+#define RULES_MAX 256
+
+const char *const rule_action_names[RULE_ACTIONS] = {
+	[RULE_INSPECT] = "inspect",
+	[RULE_SKIP] = "skip",
+};
+
+static int rule_parse_proto(const char *word, u8 *protocol)
+{
+	if (!strcmp(word, "tcp"))
+		*protocol = IPPROTO_TCP;
+	else if (!strcmp(word, "udp"))
+		*protocol = IPPROTO_UDP;
+	else if (!strcmp(word, "icmp"))
+		*protocol = IPPROTO_ICMP;
+	else
+		return kstrtou8(word, 0, protocol);
+
+	return 0;
+}
+
+static int rule_parse_family(const char *word, u8 *family)
+{
+	if (!strcmp(word, "ipv4"))
+		*family = AF_INET;
+	else if (!strcmp(word, "ipv6"))
+		*family = AF_INET6;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int rule_parse_cidr(char *word, __be32 *addr, __be32 *mask)
+{
+	char *len_str = strchr(word, '/');
+	u8 len = 32;
+	int err;
+
+	if (len_str) {
+		*len_str++ = '\0';
+		err = kstrtou8(len_str, 10, &len);
+		if (err)
+			return err;
+		if (len > 32)
+			return -EINVAL;
+	}
+	if (!in4_pton(word, -1, (u8 *)addr, -1, NULL))
+		return -EINVAL;
+	*mask = len ? htonl(~0U << (32 - len)) : 0;
+	*addr &= *mask;
+
+	return 0;
+}
+
+static int rule_parse_ports(char *word, u16 *lo, u16 *hi)
+{
+	char *hi_str = strchr(word, '-');
+	int err;
+
+	if (hi_str)
+		*hi_str++ = '\0';
+	err = kstrtou16(word, 10, lo);
+	if (err)
+		return err;
+	if (!hi_str) {
+		*hi = *lo;
+		return 0;
+	}
+	err = kstrtou16(hi_str, 10, hi);
+	if (err)
+		return err;
+
+	return *hi < *lo ? -EINVAL : 0;
+}
+
+static char *rule_next_word(char **line)
+{
+	char *word;
+
+	do {
+		word = strsep(line, " \t");
+	} while (word && !*word);
+
+	return word;
+}
+
+static int rule_parse(char *line, struct rule *r)
+{
+	char *key, *val;
+	int action, err;
+
+	*r = (struct rule){ .sport_hi = U16_MAX, .dport_hi = U16_MAX };
+	action = match_string(rule_action_names, RULE_ACTIONS,
+			      rule_next_word(&line));
+	if (action < 0)
+		return action;
+	r->action = action;
+
+	while ((key = rule_next_word(&line))) {
+		val = rule_next_word(&line);
+		if (!val)
+			return -EINVAL;
+		if (!strcmp(key, "proto"))
+			err = rule_parse_proto(val, &r->protocol);
+		else if (!strcmp(key, "src"))
+			err = rule_parse_cidr(val, &r->saddr, &r->smask);
+		else if (!strcmp(key, "dst"))
+			err = rule_parse_cidr(val, &r->daddr, &r->dmask);
+		else if (!strcmp(key, "family"))
+			err = rule_parse_family(val, &r->family);
+		else if (!strcmp(key, "sport"))
+			err = rule_parse_ports(val, &r->sport_lo, &r->sport_hi);
+		else if (!strcmp(key, "dport"))
+			err = rule_parse_ports(val, &r->dport_lo, &r->dport_hi);
+		else
+			err = -EINVAL;
+		if (err)
+			return err;
+	}
+	if (r->smask || r->dmask) {
+		if (r->family && r->family != AF_INET)
+			return -EINVAL;
+		r->family = AF_INET;
+	}
+
+	return 0;
+}
+
+/* Builds a new table from @buf, which is modified in the process */
+struct rule_table *rules_parse(char *buf)
+{
+	struct rule_table *table;
+	unsigned int lineno = 0;
+	char *line;
+	int err;
+
+	table = kzalloc(struct_size(table, rules, RULES_MAX), GFP_KERNEL);
+	if (!table)
+		return ERR_PTR(-ENOMEM);
+
+	while ((line = strsep(&buf, "\n"))) {
+		lineno++;
+		line = strim(line);
+		if (!*line || *line == '#')
+			continue;
+		err = -E2BIG;
+		if (table->nr_rules == RULES_MAX)
+			goto out;
+		err = rule_parse(line, &table->rules[table->nr_rules]);
+		if (err) {
+			pr_err("eudyptula: bad rule on line %u\n", lineno);
+			goto out;
+		}
+		table->nr_rules++;
+	}
+
+	return table;
+out:
+	kfree(table);
+	return ERR_PTR(err);
+}
+
+void rules_show(struct seq_file *m, const struct rule_table *table)
+{
+	const struct rule *r;
+	unsigned int i;
+
+	for (i = 0; table && i < table->nr_rules; i++) {
+		r = &table->rules[i];
+		seq_puts(m, rule_action_names[r->action]);
+		if (r->family)
+			seq_printf(m, " family %s",
+				   r->family == AF_INET ? "ipv4" : "ipv6");
+		if (r->protocol)
+			seq_printf(m, " proto %u", r->protocol);
+		if (r->smask)
+			seq_printf(m, " src %pI4/%d", &r->saddr,
+				   32 - ffs(ntohl(r->smask)) + 1);
+		if (r->dmask)
+			seq_printf(m, " dst %pI4/%d", &r->daddr,
+				   32 - ffs(ntohl(r->dmask)) + 1);
+		if (r->sport_lo || r->sport_hi != U16_MAX)
+			seq_printf(m, " sport %u-%u", r->sport_lo, r->sport_hi);
+		if (r->dport_lo || r->dport_hi != U16_MAX)
+			seq_printf(m, " dport %u-%u", r->dport_lo, r->dport_hi);
+		seq_putc(m, '\n');
+	}
+}
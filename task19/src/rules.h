@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * A short table of first-match-wins rules, checked before anything expensive
+ * is done to a packet, to decide whether it's worth inspecting at all.
+ */
+#ifndef _EUDYPTULA_RULES_H
+#define _EUDYPTULA_RULES_H
+
+#include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+
+#include "eudyptula_event.h"
+
+enum rule_action {
+	RULE_INSPECT,
+	RULE_SKIP,
+	RULE_ACTIONS
+};
+
+extern const char *const rule_action_names[RULE_ACTIONS];
+
+/*
+ * Addresses in network byte order, ports in host order, 0 for any protocol or
+ * family.  Only IPv4 addresses can be matched, so giving one sets the family.
+ */
+struct rule {
+	__be32 saddr;
+	__be32 smask;
+	__be32 daddr;
+	__be32 dmask;
+	u16 sport_lo;
+	u16 sport_hi;
+	u16 dport_lo;
+	u16 dport_hi;
+	u8 protocol;
+	u8 family;
+	u8 action;
+};
+
+struct rule_table {
+	struct rcu_head rcu;
+	unsigned int nr_rules;
+	struct rule rules[] ____cacheline_aligned;
+};
+
+static inline bool rule_port_in(u16 port, u16 lo, u16 hi)
+{
+	return (u16)(port - lo) <= (u16)(hi - lo);
+}
+
+static inline bool rule_match(const struct rule *r,
+			      const struct eudyptula_event *event)
+{
+	return (!r->family || r->family == event->family) &&
+	       !((event->saddr[0] ^ r->saddr) & r->smask) &&
+	       !((event->daddr[0] ^ r->daddr) & r->dmask) &&
+	       (!r->protocol || r->protocol == event->protocol) &&
+	       rule_port_in(ntohs(event->sport), r->sport_lo, r->sport_hi) &&
+	       rule_port_in(ntohs(event->dport), r->dport_lo, r->dport_hi);
+}
+
+/* Action of the first rule the packet matches, or @dflt */
+static inline enum rule_action rules_action(const struct rule_table *table,
+					    const struct eudyptula_event *event,
+					    enum rule_action dflt)
+{
+	unsigned int i;
+
+	if (!table)
+		return dflt;
+	for (i = 0; i < table->nr_rules; i++)
+		if (rule_match(&table->rules[i], event))
+			return table->rules[i].action;
+
+	return dflt;
+}
+
+struct rule_table *rules_parse(char *buf);
+void rules_show(struct seq_file *m, const struct rule_table *table);
+
+#endif /* _EUDYPTULA_RULES_H */